@@ -0,0 +1,230 @@
+/* lua-cmsgpack benchmark harness.
+ *
+ * Embeds a Lua interpreter, links lua_cmsgpack.c directly and runs every
+ * case of a corpus (see corpus.lua) through pack, unpack, unpack_one and
+ * unpack_limit. Results are printed one JSON object per line so that the
+ * output of two commits can be diffed or fed to a script:
+ *
+ *   ./cmsgpack_bench bench/corpus.lua [iteration-scale] > bench_output.txt
+ *
+ * For every case/operation pair the harness reports throughput (MB/s of
+ * encoded data and Lua objects/s), allocations performed by the Lua
+ * allocator per operation, and median / p99 latency of a single operation. */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+    #define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+LUALIB_API int luaopen_cmsgpack(lua_State *L);
+
+#define BENCH_WARMUP_DIVISOR 10 /* Warm up with 1/10th of the iterations. */
+
+/* ---------------------------- Counting allocator ---------------------------
+ * Every allocation done by the Lua state (and so by lua_cmsgpack.c, that uses
+ * lua_getallocf()) goes through this function, so we can report how many
+ * allocations a single operation costs. */
+
+typedef struct bench_alloc_stats {
+    uint64_t allocs;
+    uint64_t bytes;
+} bench_alloc_stats;
+
+static void *bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    bench_alloc_stats *stats = (bench_alloc_stats*)ud;
+
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    stats->allocs++;
+    if (ptr == NULL || nsize > osize)
+        stats->bytes += nsize;
+    return realloc(ptr, nsize);
+}
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* ------------------------------- Operations --------------------------------
+ * Every operation expects the case table at stack index 'ci' and the packed
+ * form of the case at index 'pi', and leaves the stack as it found it. */
+
+#define BENCH_OP_PACK         0
+#define BENCH_OP_UNPACK       1
+#define BENCH_OP_UNPACK_ONE   2
+#define BENCH_OP_UNPACK_LIMIT 3
+#define BENCH_OPS             4
+
+static const char *bench_op_names[BENCH_OPS] = {
+    "pack", "unpack", "unpack_one", "unpack_limit"
+};
+
+static void bench_op(lua_State *L, int op, int ci, int pi, int nvalues) {
+    int top = lua_gettop(L), i;
+    lua_Integer offset;
+
+    luaL_checkstack(L, nvalues + 4, "in function bench_op");
+    lua_getglobal(L, "cmsgpack");
+    lua_getfield(L, -1, bench_op_names[op]);
+    switch(op) {
+    case BENCH_OP_PACK:
+        lua_getfield(L, ci, "values");
+        for (i = 1; i <= nvalues; i++) lua_rawgeti(L, top+3, i);
+        lua_remove(L, top+3);
+        lua_call(L, nvalues, 1);
+        break;
+    case BENCH_OP_UNPACK:
+        lua_pushvalue(L, pi);
+        lua_call(L, 1, LUA_MULTRET);
+        break;
+    case BENCH_OP_UNPACK_ONE:
+        offset = 0;
+        while (offset != -1) {
+            lua_pushvalue(L, top+2);
+            lua_pushvalue(L, pi);
+            lua_pushinteger(L, offset);
+            lua_call(L, 2, 2);
+            offset = lua_tointeger(L, -2);
+            lua_pop(L, 2);
+        }
+        break;
+    case BENCH_OP_UNPACK_LIMIT:
+        lua_pushvalue(L, pi);
+        lua_pushinteger(L, nvalues);
+        lua_call(L, 2, LUA_MULTRET);
+        break;
+    }
+    lua_settop(L, top);
+}
+
+static void bench_case(lua_State *L, bench_alloc_stats *stats, double scale) {
+    int ci = lua_gettop(L), pi, op, nvalues, iterations, i;
+    const char *name;
+    size_t packed_len;
+    lua_Number objects;
+    uint64_t *lat;
+
+    lua_getfield(L, ci, "name");
+    name = lua_tostring(L, -1);
+    lua_getfield(L, ci, "iterations");
+    iterations = (int)(lua_tonumber(L, -1) * scale);
+    if (iterations < 1) iterations = 1;
+    lua_getfield(L, ci, "objects");
+    objects = lua_tonumber(L, -1);
+    lua_getfield(L, ci, "values");
+#if LUA_VERSION_NUM < 502
+    nvalues = (int)lua_objlen(L, -1);
+#else
+    nvalues = (int)lua_rawlen(L, -1);
+#endif
+    lua_pop(L, 3); /* Keep the name on the stack, it is used below. */
+
+    /* Pack once to get the input of the unpack operations. */
+    luaL_checkstack(L, nvalues + 4, "in function bench_case");
+    lua_getglobal(L, "cmsgpack");
+    lua_getfield(L, -1, "pack");
+    lua_getfield(L, ci, "values");
+    for (i = 1; i <= nvalues; i++) lua_rawgeti(L, ci+4, i);
+    lua_remove(L, ci+4);
+    lua_call(L, nvalues, 1);
+    lua_remove(L, -2);
+    pi = lua_gettop(L);
+    lua_tolstring(L, pi, &packed_len);
+
+    lat = (uint64_t*)malloc(sizeof(*lat) * iterations);
+    for (op = 0; op < BENCH_OPS; op++) {
+        uint64_t allocs, total = 0;
+
+        for (i = 0; i < iterations / BENCH_WARMUP_DIVISOR; i++)
+            bench_op(L, op, ci, pi, nvalues);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+
+        allocs = stats->allocs;
+        for (i = 0; i < iterations; i++) {
+            uint64_t start = bench_now();
+            bench_op(L, op, ci, pi, nvalues);
+            lat[i] = bench_now() - start;
+            total += lat[i];
+        }
+        allocs = stats->allocs - allocs;
+        qsort(lat, iterations, sizeof(*lat), bench_cmp_u64);
+
+        printf("{\"case\":\"%s\",\"op\":\"%s\",\"iterations\":%d,"
+               "\"bytes\":%lu,\"objects\":%.0f,"
+               "\"mb_per_s\":%.2f,\"objects_per_s\":%.0f,"
+               "\"allocs_per_op\":%.2f,\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+            name, bench_op_names[op], iterations,
+            (unsigned long)packed_len, objects,
+            (double)packed_len * iterations / 1048576.0 / (total / 1e9),
+            objects * iterations / (total / 1e9),
+            (double)allocs / iterations,
+            (unsigned long long)lat[iterations / 2],
+            (unsigned long long)lat[(iterations * 99) / 100]);
+        fflush(stdout);
+    }
+    free(lat);
+    lua_settop(L, ci);
+}
+
+int main(int argc, char **argv) {
+    bench_alloc_stats stats = {0, 0};
+    const char *corpus = argc > 1 ? argv[1] : "bench/corpus.lua";
+    double scale = argc > 2 ? atof(argv[2]) : 1.0;
+    lua_State *L;
+    int i, ncases;
+
+    L = lua_newstate(bench_alloc, &stats);
+    if (L == NULL) {
+        fprintf(stderr, "Cannot create Lua state.\n");
+        return 1;
+    }
+    luaL_openlibs(L);
+    lua_pushcfunction(L, luaopen_cmsgpack);
+    lua_call(L, 0, 1);
+    lua_setglobal(L, "cmsgpack");
+
+    if (luaL_dofile(L, corpus)) {
+        fprintf(stderr, "Cannot load corpus: %s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+
+    lua_getglobal(L, "cmsgpack");
+    lua_getfield(L, -1, "_VERSION");
+    printf("{\"lua\":\"%s\",\"cmsgpack\":\"%s\",\"scale\":%.2f}\n",
+        LUA_VERSION_NUM < 502 ? "5.1" : (LUA_VERSION_NUM < 503 ? "5.2" : "5.3"),
+        lua_tostring(L, -1), scale);
+    lua_pop(L, 2);
+
+#if LUA_VERSION_NUM < 502
+    ncases = (int)lua_objlen(L, -1);
+#else
+    ncases = (int)lua_rawlen(L, -1);
+#endif
+    for (i = 1; i <= ncases; i++) {
+        lua_rawgeti(L, -1, i);
+        bench_case(L, &stats, scale);
+        lua_pop(L, 1);
+    }
+    lua_close(L);
+    return 0;
+}
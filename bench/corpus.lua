@@ -0,0 +1,80 @@
+-- lua-cmsgpack benchmark corpus.
+-- Returns a list of cases, each one being a stream of top-level values that
+-- bench.c packs and unpacks as a single message. Values are generated with a
+-- fixed-seed LCG so that every run (and every Lua version) sees the same data.
+
+-- The multiplier 1103515245 is split as 16838 * 65536 + 20077, so that no
+-- intermediate result exceeds 2^53 and doubles compute it exactly too.
+local seed = 42
+local function rand(n)
+    seed = ((seed * 16838 % 32768) * 65536 + seed * 20077 + 12345) % 2147483648
+    return seed % n
+end
+
+local function word(len)
+    local t = {}
+    for i = 1, len do t[i] = string.char(97 + rand(26)) end
+    return table.concat(t)
+end
+
+-- Total number of Lua values (including nested ones) in a value.
+local function count(v)
+    if type(v) ~= "table" then return 1 end
+    local n = 1
+    for k, x in pairs(v) do n = n + count(k) + count(x) end
+    return n
+end
+
+local function rpc_message(i)
+    return {
+        id = i,
+        method = "entity.update",
+        params = {
+            entity = 1000 + rand(5000),
+            position = {rand(4000) / 8, rand(4000) / 8, rand(400) / 4},
+            heading = rand(3600) / 10,
+            flags = {true, false, rand(2) == 1},
+            owner = word(12),
+        },
+    }
+end
+
+local cases = {}
+
+local function add(name, iterations, values)
+    local objects = 0
+    for i = 1, #values do objects = objects + count(values[i]) end
+    cases[#cases+1] = {
+        name = name,
+        iterations = iterations,
+        values = values,
+        objects = objects,
+    }
+end
+
+add("small_rpc", 20000, {rpc_message(1)})
+
+local wide = {}
+for i = 1, 1000 do wide[word(8) .. i] = (i % 3 == 0) and word(10) or rand(100000) end
+add("wide_map", 500, {wide})
+
+-- 16 nested tables, exactly LUACMSGPACK_MAX_NESTING: the deepest value that
+-- is encoded without being truncated to nil.
+local deep = {leaf = "bottom", n = 0}
+for i = 1, 15 do deep = {child = deep, n = i, tag = word(4)} end
+add("deep_nesting", 20000, {deep})
+
+local floats = {}
+for i = 1, 4096 do floats[i] = (rand(2000000) - 1000000) / 1000 + 0.001 end
+add("float_array", 500, {floats})
+
+local strings = {}
+for i = 1, 4 do strings[i] = word(1024) end
+strings[5] = string.rep(word(1024), 256)
+add("long_strings", 200, strings)
+
+local stream = {}
+for i = 1, 256 do stream[i] = rpc_message(i) end
+add("multi_stream", 100, stream)
+
+return cases
@@ -1,8 +1,21 @@
+/* clock_gettime() is only declared by the C library in POSIX mode, which
+ * -std=c99 disables, so ask for it when the instrumentation is compiled in. */
+#if defined(LUACMSGPACK_STATS) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+    #define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <locale.h>
+#include <float.h>
+#ifdef LUACMSGPACK_STATS
+#include <time.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -17,6 +30,38 @@
 #ifndef LUACMSGPACK_MAX_NESTING
     #define LUACMSGPACK_MAX_NESTING  16 /* Max tables nesting. */
 #endif
+#ifndef LUACMSGPACK_MAX_JSON_NESTING
+    #define LUACMSGPACK_MAX_JSON_NESTING 256 /* Max to_json/from_json nesting. */
+#endif
+
+/* MessagePack extension types used for the native vector types. They can be
+ * overridden at compile time to match the ones used by the peers. */
+#ifndef LUACMSGPACK_EXT_VEC2
+    #define LUACMSGPACK_EXT_VEC2            20
+#endif
+#ifndef LUACMSGPACK_EXT_VEC3
+    #define LUACMSGPACK_EXT_VEC3            21
+#endif
+#ifndef LUACMSGPACK_EXT_VEC4
+    #define LUACMSGPACK_EXT_VEC4            22
+#endif
+#ifndef LUACMSGPACK_EXT_FLOAT32_ARRAY
+    #define LUACMSGPACK_EXT_FLOAT32_ARRAY   23
+#endif
+#ifndef LUACMSGPACK_EXT_INT32_ARRAY
+    #define LUACMSGPACK_EXT_INT32_ARRAY     24
+#endif
+#ifndef LUACMSGPACK_EXT_DELTA
+    #define LUACMSGPACK_EXT_DELTA           25  /* Nested pack_delta() patch. */
+#endif
+#ifndef LUACMSGPACK_EXT_KEY
+    #define LUACMSGPACK_EXT_KEY             26  /* Dictionary key reference. */
+#endif
+
+#define LUACMSGPACK_VECTOR_MT       "cmsgpack.vector"
+#define LUACMSGPACK_TYPED_ARRAY_MT  "cmsgpack.typed_array"
+#define LUACMSGPACK_DICTIONARY_MT   "cmsgpack.dictionary"
+#define LUACMSGPACK_MAX_DICTIONARY  65536   /* Max keys of a dictionary. */
 
 /* Check if float or double can be an integer without loss of precision */
 #define IS_INT_TYPE_EQUIVALENT(x, T) (!isinf(x) && (T)(x) == (x))
@@ -84,15 +129,336 @@ void memrevifle(void *ptr, size_t len) {
     }
 }
 
+/* Like memrevifle() but for 'count' consecutive 32 bit words, reversing each
+ * one in place. Used for bulk copies of float and int32 arrays. */
+void memrev32ifle(void *ptr, size_t count) {
+    unsigned char *p = (unsigned char *)ptr;
+    uint32_t w;
+    int test = 1;
+    unsigned char *testp = (unsigned char*) &test;
+
+    if (testp[0] == 0) return; /* Big endian, nothing to do. */
+    while(count--) {
+        memcpy(&w,p,4);
+        w = (w >> 24) | ((w >> 8) & 0xff00) | ((w << 8) & 0xff0000) | (w << 24);
+        memcpy(p,&w,4);
+        p += 4;
+    }
+}
+
+/* -------------------------------- Hashing ------------------------------------
+ * A streaming implementation of XXH64 (seed 0), used to compute the digest of
+ * packed data while it is encoded or decoded. It is implemented here to keep
+ * the library dependency free; results match the reference implementation. */
+
+#define MP_XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define MP_XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define MP_XXH_PRIME3 0x165667B19E3779F9ULL
+#define MP_XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define MP_XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+/* Bytes accumulated by the encoder / decoder before they are hashed: small
+ * enough to be still in cache, big enough to hash whole 32 byte stripes. */
+#define MP_HASH_BLOCK 256
+
+typedef struct mp_xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memsize;
+} mp_xxh64;
+
+#define mp_xxh_rotl(_x,_r) (((_x) << (_r)) | ((_x) >> (64 - (_r))))
+
+uint64_t mp_xxh_read64(const unsigned char *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+uint64_t mp_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * MP_XXH_PRIME2;
+    acc = mp_xxh_rotl(acc,31);
+    return acc * MP_XXH_PRIME1;
+}
+
+uint64_t mp_xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= mp_xxh_round(0,val);
+    return acc * MP_XXH_PRIME1 + MP_XXH_PRIME4;
+}
+
+void mp_xxh64_init(mp_xxh64 *h) {
+    h->v[0] = MP_XXH_PRIME1 + MP_XXH_PRIME2;
+    h->v[1] = MP_XXH_PRIME2;
+    h->v[2] = 0;
+    h->v[3] = 0 - MP_XXH_PRIME1;
+    h->total = 0;
+    h->memsize = 0;
+}
+
+/* Process the 32 byte stripes of 'p', returning the number of bytes used. */
+size_t mp_xxh64_stripes(mp_xxh64 *h, const unsigned char *p, size_t len) {
+    const unsigned char *start = p;
+
+    while (len >= 32) {
+        h->v[0] = mp_xxh_round(h->v[0],mp_xxh_read64(p));
+        h->v[1] = mp_xxh_round(h->v[1],mp_xxh_read64(p+8));
+        h->v[2] = mp_xxh_round(h->v[2],mp_xxh_read64(p+16));
+        h->v[3] = mp_xxh_round(h->v[3],mp_xxh_read64(p+24));
+        p += 32;
+        len -= 32;
+    }
+    return p - start;
+}
+
+void mp_xxh64_update(mp_xxh64 *h, const unsigned char *p, size_t len) {
+    size_t used;
+
+    h->total += len;
+    if (h->memsize) {
+        used = 32 - h->memsize;
+        if (used > len) used = len;
+        memcpy(h->mem+h->memsize,p,used);
+        h->memsize += used;
+        p += used;
+        len -= used;
+        if (h->memsize < 32) return;
+        mp_xxh64_stripes(h,h->mem,32);
+        h->memsize = 0;
+    }
+    used = mp_xxh64_stripes(h,p,len);
+    memcpy(h->mem,p+used,len-used);
+    h->memsize = len-used;
+}
+
+uint64_t mp_xxh64_digest(const mp_xxh64 *h) {
+    const unsigned char *p = h->mem, *e = h->mem + h->memsize;
+    uint64_t acc;
+
+    if (h->total >= 32) {
+        acc = mp_xxh_rotl(h->v[0],1) + mp_xxh_rotl(h->v[1],7) +
+              mp_xxh_rotl(h->v[2],12) + mp_xxh_rotl(h->v[3],18);
+        acc = mp_xxh_merge(acc,h->v[0]);
+        acc = mp_xxh_merge(acc,h->v[1]);
+        acc = mp_xxh_merge(acc,h->v[2]);
+        acc = mp_xxh_merge(acc,h->v[3]);
+    } else {
+        acc = MP_XXH_PRIME5;
+    }
+    acc += h->total;
+    for (; p + 8 <= e; p += 8) {
+        acc ^= mp_xxh_round(0,mp_xxh_read64(p));
+        acc = mp_xxh_rotl(acc,27) * MP_XXH_PRIME1 + MP_XXH_PRIME4;
+    }
+    if (p + 4 <= e) {
+        acc ^= ((uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+                ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)) * MP_XXH_PRIME1;
+        acc = mp_xxh_rotl(acc,23) * MP_XXH_PRIME2 + MP_XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < e; p++) {
+        acc ^= *p * MP_XXH_PRIME5;
+        acc = mp_xxh_rotl(acc,11) * MP_XXH_PRIME1;
+    }
+    acc ^= acc >> 33;
+    acc *= MP_XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= MP_XXH_PRIME3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+/* ---------------------------- Instrumentation --------------------------------
+ * When compiled with LUACMSGPACK_STATS defined, every Lua state gets a set of
+ * counters stored in its registry, exported to Lua via cmsgpack.stats() and
+ * cleared with cmsgpack.reset_stats(). Without the define the MP_STAT_*
+ * macros expand to nothing and the two functions are not registered, so
+ * there is no overhead at all in regular builds. */
+
+#ifdef LUACMSGPACK_STATS
+
+#define MP_STAT_NIL     0
+#define MP_STAT_BOOLEAN 1
+#define MP_STAT_INTEGER 2
+#define MP_STAT_FLOAT   3
+#define MP_STAT_STRING  4
+#define MP_STAT_ARRAY   5
+#define MP_STAT_MAP     6
+#define MP_STAT_OTHER   7
+#define MP_STAT_TYPES   8
+
+typedef struct mp_stats {
+    uint64_t bytes_encoded, bytes_decoded;
+    uint64_t encoded[MP_STAT_TYPES], decoded[MP_STAT_TYPES];
+    uint64_t realloc_calls, realloc_bytes;
+    uint64_t tables_as_array, tables_as_map;
+    uint64_t max_encode_depth, max_decode_depth;
+    uint64_t pack_calls, unpack_calls;
+    uint64_t pack_ns, unpack_ns;
+} mp_stats;
+
+static const char *mp_stats_type_names[MP_STAT_TYPES] = {
+    "nil", "boolean", "integer", "float", "string", "array", "map", "other"
+};
+
+/* The address of this variable is the registry key of the stats userdata. */
+static const char mp_stats_key = 'S';
+
+/* Return the stats of the Lua state, creating them on first access. */
+mp_stats *mp_stats_get(lua_State *L) {
+    mp_stats *stats;
+
+    lua_pushlightuserdata(L, (void*)&mp_stats_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    stats = (mp_stats*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (stats == NULL) {
+        lua_pushlightuserdata(L, (void*)&mp_stats_key);
+        stats = (mp_stats*)lua_newuserdata(L, sizeof(*stats));
+        memset(stats, 0, sizeof(*stats));
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    return stats;
+}
+
+/* Monotonic clock in nanoseconds, falling back to the (coarser) processor
+ * time where no POSIX clock is available. */
+uint64_t mp_stats_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+    return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+/* Map the first byte of an encoded object to one of the MP_STAT_* types. */
+int mp_stats_classify(unsigned char b) {
+    if (b <= 0x7f || b >= 0xe0 || (b >= 0xcc && b <= 0xd3)) return MP_STAT_INTEGER;
+    if (b <= 0x8f || b == 0xde || b == 0xdf) return MP_STAT_MAP;
+    if (b <= 0x9f || b == 0xdc || b == 0xdd) return MP_STAT_ARRAY;
+    if (b <= 0xbf || (b >= 0xd9 && b <= 0xdb)) return MP_STAT_STRING;
+    if (b == 0xc0) return MP_STAT_NIL;
+    if (b == 0xc2 || b == 0xc3) return MP_STAT_BOOLEAN;
+    if (b == 0xca || b == 0xcb) return MP_STAT_FLOAT;
+    return MP_STAT_OTHER;
+}
+
+#define MP_STAT_ADD(_s,_field,_n) do { \
+    if (_s) (_s)->_field += (_n); \
+} while(0)
+
+#define MP_STAT_MAX(_s,_field,_n) do { \
+    if ((_s) && (uint64_t)(_n) > (_s)->_field) (_s)->_field = (_n); \
+} while(0)
+
+#else
+
+#define MP_STAT_ADD(_s,_field,_n) do {} while(0)
+#define MP_STAT_MAX(_s,_field,_n) do {} while(0)
+
+#endif
+
+/* ---------------------------- Error reporting --------------------------------
+ * The functions of the safe API are registered as closures with a true
+ * upvalue, and report errors returning nil and the error message instead of
+ * raising them, so that no protected call is needed on the success path. The
+ * encoder and the decoder never raise errors themselves, they carry them in
+ * mp_buf.err and mp_cur.err up to the Lua function, that reports them with
+ * mp_fail(). Errors raised by Lua itself, like out of memory, still raise.
+ * -------------------------------------------------------------------------- */
+
+#define mp_safe_mode(L) lua_toboolean(L,lua_upvalueindex(1))
+
+/* Raise the error, or return nil and the error message in safe mode. The
+ * result is meant to be returned by the calling Lua function. */
+int mp_fail(lua_State *L, const char *fmt, ...) {
+    va_list ap;
+
+    luaL_checkstack(L, 2, "in function mp_fail");
+    va_start(ap,fmt);
+    if (!mp_safe_mode(L)) {
+        luaL_where(L,1);
+        lua_pushvfstring(L,fmt,ap);
+        va_end(ap);
+        lua_concat(L,2);
+        return lua_error(L);
+    }
+    lua_pushnil(L);
+    lua_pushvfstring(L,fmt,ap);
+    va_end(ap);
+    return 2;
+}
+
+/* Same as mp_fail() for luaL_argerror(). */
+int mp_fail_arg(lua_State *L, int arg, const char *msg) {
+    if (!mp_safe_mode(L)) return luaL_argerror(L,arg,msg);
+    return mp_fail(L,"bad argument #%d (%s)",arg,msg);
+}
+
+/* Same as mp_fail() for an argument of the wrong type. */
+int mp_fail_type(lua_State *L, int arg, const char *tname) {
+    return mp_fail_arg(L,arg,lua_pushfstring(L,"%s expected, got %s",
+                                             tname,luaL_typename(L,arg)));
+}
+
+/* Same as luaL_optinteger(), storing the argument in '*v' and returning 0,
+ * or the result of mp_fail() if the argument is not an integer. */
+int mp_opt_integer(lua_State *L, int arg, lua_Integer def, lua_Integer *v) {
+    if (lua_isnoneornil(L,arg)) {
+        *v = def;
+        return 0;
+    }
+#if LUA_VERSION_NUM >= 503
+    {
+        int isnum;
+
+        *v = lua_tointegerx(L,arg,&isnum);
+        if (isnum) return 0;
+    }
+    if (lua_isnumber(L,arg))
+        return mp_fail_arg(L,arg,"number has no integer representation");
+#else
+    if (lua_isnumber(L,arg)) {
+        *v = lua_tointeger(L,arg);
+        return 0;
+    }
+#endif
+    return mp_fail_type(L,arg,"number");
+}
+
 /* ---------------------------- String buffer ----------------------------------
  * This is a simple implementation of string buffers. The only operation
  * supported is creating empty buffers and appending bytes to it.
  * The string buffer uses 2x preallocation on every realloc for O(N) append
- * behavior.  */
+ * behavior.
+ *
+ * A buffer can also be a "sizing" buffer: it never stores anything and only
+ * counts the bytes appended, so that running the encoder against it computes
+ * the exact encoded length. When the count goes past 'limit' the error field
+ * is set, and the encoder stops as soon as it notices. */
+
+#define MP_BUF_ERROR_NONE   0
+#define MP_BUF_ERROR_LIMIT  1   /* Sizing went past the requested limit. */
+#define MP_BUF_ERROR_STACK  2   /* No room left in the Lua stack. */
+#define MP_BUF_ERROR_DEPTH  3   /* Delta of tables nested too deeply. */
 
 typedef struct mp_buf {
     unsigned char *b;
     size_t len, free;
+    size_t limit;
+    int sizing;
+    int err;
+    mp_xxh64 *hash;         /* If not NULL, digest of the appended data. */
+    size_t hashed;          /* Bytes of 'b' already fed to 'hash'. */
+    int dict;               /* Stack index of the key -> index table, or 0. */
+    int strict_depth;       /* Tables too deep are an error, not nil. */
+#ifdef LUACMSGPACK_STATS
+    mp_stats *stats;
+#endif
 } mp_buf;
 
 void *mp_realloc(lua_State *L, void *target, size_t osize,size_t nsize) {
@@ -112,19 +478,103 @@ mp_buf *mp_buf_new(lua_State *L) {
 
     buf->b = NULL;
     buf->len = buf->free = 0;
+    buf->limit = SIZE_MAX;
+    buf->sizing = 0;
+    buf->err = MP_BUF_ERROR_NONE;
+    buf->hash = NULL;
+    buf->hashed = 0;
+    buf->dict = 0;
+    buf->strict_depth = 0;
+#ifdef LUACMSGPACK_STATS
+    buf->stats = mp_stats_get(L);
+#endif
+    MP_STAT_ADD(buf->stats,realloc_calls,1);
+    MP_STAT_ADD(buf->stats,realloc_bytes,sizeof(*buf));
     return buf;
 }
 
+/* Sizing buffers live on the C stack: nothing is ever allocated for them. */
+void mp_buf_init_sizing(mp_buf *buf, size_t limit) {
+    buf->b = NULL;
+    buf->len = buf->free = 0;
+    buf->limit = limit;
+    buf->sizing = 1;
+    buf->err = MP_BUF_ERROR_NONE;
+    buf->hash = NULL;
+    buf->hashed = 0;
+    buf->dict = 0;
+    buf->strict_depth = 0;
+#ifdef LUACMSGPACK_STATS
+    buf->stats = NULL;
+#endif
+}
+
+/* Make sure there is room for at least 'len' more bytes, with a single
+ * allocation of exactly the needed size if the buffer must grow. */
+void mp_buf_reserve(lua_State *L, mp_buf *buf, size_t len) {
+    if (buf->sizing || buf->free >= len) return;
+    buf->b = (unsigned char*)mp_realloc(L, buf->b, buf->len + buf->free, buf->len + len);
+    buf->free = len;
+    MP_STAT_ADD(buf->stats,realloc_calls,1);
+    MP_STAT_ADD(buf->stats,realloc_bytes,buf->len + len);
+}
+
+/* Grow the buffer so that 'len' more bytes fit, with 2x preallocation. */
+void mp_buf_grow(lua_State *L, mp_buf *buf, size_t len) {
+    size_t newsize = (buf->len+len)*2;
+
+    buf->b = (unsigned char*)mp_realloc(L, buf->b, buf->len + buf->free, newsize);
+    buf->free = newsize - buf->len;
+    MP_STAT_ADD(buf->stats,realloc_calls,1);
+    MP_STAT_ADD(buf->stats,realloc_bytes,newsize);
+}
+
+/* Feed the hash with the data appended since the last call: only whole
+ * stripes, unless 'final' is true, so that no byte is buffered twice. */
+void mp_buf_hash(mp_buf *buf, int final) {
+    size_t len = buf->len - buf->hashed;
+
+    if (!final) len &= ~(size_t)31;
+    mp_xxh64_update(buf->hash,buf->b+buf->hashed,len);
+    buf->hashed += len;
+}
+
+#define mp_buf_hash_pending(_buf) do { \
+    if (_buf->hash && _buf->len - _buf->hashed >= MP_HASH_BLOCK) \
+        mp_buf_hash(_buf,0); \
+} while(0)
+
 void mp_buf_append(lua_State *L, mp_buf *buf, const unsigned char *s, size_t len) {
     if (buf->free < len) {
-        size_t newsize = (buf->len+len)*2;
+        /* A sizing buffer never has free space, so it always gets here. */
+        if (buf->sizing) {
+            buf->len += len;
+            if (buf->len > buf->limit) buf->err = MP_BUF_ERROR_LIMIT;
+            return;
+        }
+        mp_buf_grow(L,buf,len);
+    }
+    memcpy(buf->b+buf->len,s,len);
+    buf->len += len;
+    buf->free -= len;
+    mp_buf_hash_pending(buf);
+}
+
+/* Append 'count' 32 bit words stored in host order, writing them big endian
+ * with a single copy followed by an in place bulk swap. */
+void mp_buf_append_words32(lua_State *L, mp_buf *buf, const void *s, size_t count) {
+    size_t len = count*4;
 
-        buf->b = (unsigned char*)mp_realloc(L, buf->b, buf->len + buf->free, newsize);
-        buf->free = newsize - buf->len;
+    if (buf->sizing) {
+        mp_buf_append(L,buf,(const unsigned char*)s,len);
+        return;
     }
+    if (buf->free < len) mp_buf_grow(L,buf,len);
     memcpy(buf->b+buf->len,s,len);
+    memrev32ifle(buf->b+buf->len,count);
     buf->len += len;
     buf->free -= len;
+    mp_buf_hash_pending(buf);
 }
 
 void mp_buf_free(lua_State *L, mp_buf *buf) {
@@ -144,17 +594,52 @@ void mp_buf_free(lua_State *L, mp_buf *buf) {
 #define MP_CUR_ERROR_NONE   0
 #define MP_CUR_ERROR_EOF    1   /* Not enough data to complete operation. */
 #define MP_CUR_ERROR_BADFMT 2   /* Bad data format */
+#define MP_CUR_ERROR_LIMIT  3   /* Input exceeds the decoding limits. */
+#define MP_CUR_ERROR_STACK  4   /* No room left in the Lua stack. */
+#define MP_CUR_ERROR_READONLY 5 /* Target is a read-only cached table. */
+
+/* Resource budgets for decoding untrusted input. A zero field means that
+ * there is no limit. Strings and ext payloads are both checked against
+ * max_string; max_objects counts every decoded value, containers and map
+ * keys included. */
+typedef struct mp_limits {
+    size_t max_bytes;       /* Length of the input. */
+    size_t max_objects;     /* Total number of decoded objects. */
+    size_t max_container;   /* Elements of a single array or map. */
+    size_t max_string;      /* Length of a single string or ext payload. */
+    size_t max_depth;       /* Nesting level of arrays and maps. */
+} mp_limits;
+
+static const mp_limits mp_no_limits = {0, 0, 0, 0, 0};
 
 typedef struct mp_cur {
     const unsigned char *p;
     size_t left;
     int err;
+    const mp_limits *limits;
+    size_t objects;         /* Objects decoded (or announced by headers). */
+    size_t depth;           /* Current nesting level. */
+    mp_xxh64 *hash;         /* If not NULL, digest of the consumed data. */
+    const unsigned char *hashed; /* Data up to here was fed to 'hash'. */
+    int dict;               /* Stack index of the index -> key array, or 0. */
+#ifdef LUACMSGPACK_STATS
+    mp_stats *stats;
+#endif
 } mp_cur;
 
 void mp_cur_init(mp_cur *cursor, const unsigned char *s, size_t len) {
     cursor->p = s;
     cursor->left = len;
     cursor->err = MP_CUR_ERROR_NONE;
+    cursor->limits = &mp_no_limits;
+    cursor->objects = 0;
+    cursor->depth = 0;
+    cursor->hash = NULL;
+    cursor->hashed = s;
+    cursor->dict = 0;
+#ifdef LUACMSGPACK_STATS
+    cursor->stats = NULL;
+#endif
 }
 
 #define mp_cur_consume(_c,_len) do { _c->p += _len; _c->left -= _len; } while(0)
@@ -169,9 +654,93 @@ void mp_cur_init(mp_cur *cursor, const unsigned char *s, size_t len) {
     } \
 } while(0)
 
+/* Same as mp_cur_need() for the max_string limit, to be checked before the
+ * string or ext payload of length '_len' is accessed. */
+#define mp_cur_need_string(_c,_len) do { \
+    if (_c->limits->max_string && (_len) > _c->limits->max_string) { \
+        _c->err = MP_CUR_ERROR_LIMIT; \
+        return; \
+    } \
+} while(0)
+
+/* Account for one top level object. Returns 0 and sets the cursor error if
+ * the max_objects limit is exceeded. */
+int mp_cur_count(mp_cur *c) {
+    if (c->limits->max_objects && c->objects >= c->limits->max_objects) {
+        c->err = MP_CUR_ERROR_LIMIT;
+        return 0;
+    }
+    c->objects++;
+    return 1;
+}
+
+/* Check the header of a container of 'len' elements, every one made of
+ * 'items' objects (1 for arrays, 2 for maps), before anything is allocated
+ * for it. Since every object takes at least one byte, a container that
+ * announces more objects than the bytes left in the input is truncated for
+ * sure and is rejected in O(1). On success the nesting level is increased
+ * (see mp_cur_leave()) and 1 is returned, otherwise the cursor error is set
+ * and 0 is returned.
+ *
+ * Decoding stops at the first error without calling mp_cur_leave() for the
+ * containers it was in, so 'depth' and 'objects' are only meaningful until
+ * then. That's fine since a cursor is never reused after an error: every
+ * call initializes its own with mp_cur_init(), and the decoder objects keep
+ * just their limits, not a cursor. */
+int mp_cur_enter(mp_cur *c, size_t len, size_t items) {
+    const mp_limits *lim = c->limits;
+
+    if (len > c->left / items) {
+        c->err = MP_CUR_ERROR_EOF;
+        return 0;
+    }
+    len *= items;
+    if ((lim->max_container && len / items > lim->max_container) ||
+        (lim->max_depth && c->depth >= lim->max_depth) ||
+        (lim->max_objects && len > lim->max_objects - c->objects))
+    {
+        c->err = MP_CUR_ERROR_LIMIT;
+        return 0;
+    }
+    c->objects += len;
+    c->depth++;
+    MP_STAT_MAX(c->stats,max_decode_depth,c->depth);
+    return 1;
+}
+
+#define mp_cur_leave(_c) ((_c)->depth--)
+
+/* Same as mp_buf_hash() for the data consumed by the cursor. */
+void mp_cur_hash(mp_cur *c, int final) {
+    size_t len = c->p - c->hashed;
+
+    if (!final) len &= ~(size_t)31;
+    mp_xxh64_update(c->hash,c->hashed,len);
+    c->hashed += len;
+}
+
+/* Report the cursor error with mp_fail(). */
+int mp_cur_error(lua_State *L, mp_cur *c) {
+    switch(c->err) {
+    case MP_CUR_ERROR_EOF:
+        return mp_fail(L,"Missing bytes in input.");
+    case MP_CUR_ERROR_LIMIT:
+        return mp_fail(L,"Input exceeds the decoding limits.");
+    case MP_CUR_ERROR_STACK:
+        lua_settop(L,0); /* Make room for the error. */
+        return mp_fail(L,"Too many values at once; "
+                         "use unpack_one or unpack_limit instead.");
+    case MP_CUR_ERROR_READONLY:
+        return mp_fail(L,"Attempt to modify a read-only table.");
+    default:
+        return mp_fail(L,"Bad data format in input.");
+    }
+}
+
 /* ------------------------- Low level MP encoding -------------------------- */
 
-void mp_encode_bytes(lua_State *L, mp_buf *buf, const unsigned char *s, size_t len) {
+/* Encode just the header of a string of 'len' bytes. */
+void mp_encode_bytes_header(lua_State *L, mp_buf *buf, size_t len) {
     unsigned char hdr[5];
     int hdrlen;
 
@@ -195,31 +764,60 @@ void mp_encode_bytes(lua_State *L, mp_buf *buf, const unsigned char *s, size_t l
         hdr[4] = len&0xff;
         hdrlen = 5;
     }
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_STRING],1);
     mp_buf_append(L,buf,hdr,hdrlen);
+}
+
+void mp_encode_bytes(lua_State *L, mp_buf *buf, const unsigned char *s, size_t len) {
+    mp_encode_bytes_header(L,buf,len);
     mp_buf_append(L,buf,s,len);
 }
 
-/* we assume IEEE 754 internal format for single and double precision floats. */
-void mp_encode_double(lua_State *L, mp_buf *buf, double d) {
-    unsigned char b[9];
+/* we assume IEEE 754 internal format for single and double precision floats.
+ * The bytes are written big endian with shifts, that compilers turn into a
+ * single byte swap instruction, so no runtime endianess check is needed.
+ * Returns the number of bytes written to 'b', that must have room for 9. */
+int mp_write_double(unsigned char *b, double d) {
     float f = d;
 
     assert(sizeof(f) == 4 && sizeof(d) == 8);
     if (d == (double)f) {
+        uint32_t u;
+
+        memcpy(&u,&f,4);
         b[0] = 0xca;    /* float IEEE 754 */
-        memcpy(b+1,&f,4);
-        memrevifle(b+1,4);
-        mp_buf_append(L,buf,b,5);
-    } else if (sizeof(d) == 8) {
+        b[1] = (u >> 24) & 0xff;
+        b[2] = (u >> 16) & 0xff;
+        b[3] = (u >> 8) & 0xff;
+        b[4] = u & 0xff;
+        return 5;
+    } else {
+        uint64_t u;
+
+        memcpy(&u,&d,8);
         b[0] = 0xcb;    /* double IEEE 754 */
-        memcpy(b+1,&d,8);
-        memrevifle(b+1,8);
-        mp_buf_append(L,buf,b,9);
+        b[1] = (u >> 56) & 0xff;
+        b[2] = (u >> 48) & 0xff;
+        b[3] = (u >> 40) & 0xff;
+        b[4] = (u >> 32) & 0xff;
+        b[5] = (u >> 24) & 0xff;
+        b[6] = (u >> 16) & 0xff;
+        b[7] = (u >> 8) & 0xff;
+        b[8] = u & 0xff;
+        return 9;
     }
 }
 
-void mp_encode_int(lua_State *L, mp_buf *buf, int64_t n) {
+void mp_encode_double(lua_State *L, mp_buf *buf, double d) {
     unsigned char b[9];
+
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_FLOAT],1);
+    mp_buf_append(L,buf,b,mp_write_double(b,d));
+}
+
+/* Write the most compact encoding of 'n' to 'b', that must have room for 9
+ * bytes. Returns the number of bytes written. */
+int mp_write_int(unsigned char *b, int64_t n) {
     int enclen;
 
     if (n >= 0) {
@@ -287,13 +885,21 @@ void mp_encode_int(lua_State *L, mp_buf *buf, int64_t n) {
             enclen = 9;
         }
     }
-    mp_buf_append(L,buf,b,enclen);
+    return enclen;
+}
+
+void mp_encode_int(lua_State *L, mp_buf *buf, int64_t n) {
+    unsigned char b[9];
+
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_INTEGER],1);
+    mp_buf_append(L,buf,b,mp_write_int(b,n));
 }
 
 void mp_encode_array(lua_State *L, mp_buf *buf, int64_t n) {
     unsigned char b[5];
     int enclen;
 
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_ARRAY],1);
     if (n <= 15) {
         b[0] = 0x90 | (n & 0xf);    /* fix array */
         enclen = 1;
@@ -317,6 +923,7 @@ void mp_encode_map(lua_State *L, mp_buf *buf, int64_t n) {
     unsigned char b[5];
     int enclen;
 
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_MAP],1);
     if (n <= 15) {
         b[0] = 0x80 | (n & 0xf);    /* fix map */
         enclen = 1;
@@ -336,6 +943,139 @@ void mp_encode_map(lua_State *L, mp_buf *buf, int64_t n) {
     mp_buf_append(L,buf,b,enclen);
 }
 
+/* Only the header: the 'len' bytes of payload must be appended by the caller. */
+void mp_encode_ext_header(lua_State *L, mp_buf *buf, int type, size_t len) {
+    unsigned char b[6];
+    int enclen;
+
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_OTHER],1);
+    if (len == 1 || len == 2 || len == 4 || len == 8 || len == 16) {
+        b[0] = len == 1 ? 0xd4 : len == 2 ? 0xd5 : len == 4 ? 0xd6 :
+               len == 8 ? 0xd7 : 0xd8;  /* fixext 1/2/4/8/16 */
+        b[1] = type & 0xff;
+        enclen = 2;
+    } else if (len <= 0xff) {
+        b[0] = 0xc7;                /* ext 8 */
+        b[1] = len & 0xff;
+        b[2] = type & 0xff;
+        enclen = 3;
+    } else if (len <= 0xffff) {
+        b[0] = 0xc8;                /* ext 16 */
+        b[1] = (len & 0xff00) >> 8;
+        b[2] = len & 0xff;
+        b[3] = type & 0xff;
+        enclen = 4;
+    } else {
+        b[0] = 0xc9;                /* ext 32 */
+        b[1] = (len & 0xff000000) >> 24;
+        b[2] = (len & 0xff0000) >> 16;
+        b[3] = (len & 0xff00) >> 8;
+        b[4] = len & 0xff;
+        b[5] = type & 0xff;
+        enclen = 6;
+    }
+    mp_buf_append(L,buf,b,enclen);
+}
+
+/* ---------------------------- Native vector types ----------------------------
+ * Positions, directions and sample buffers are very common in our payloads,
+ * and representing them as Lua tables costs a table per value plus a generic
+ * encoding of every component. So the library provides two userdata types:
+ *
+ * - vectors of 2, 3 or 4 floats (cmsgpack.vec2/vec3/vec4), and
+ * - typed arrays of float32 or int32 (cmsgpack.float32_array/int32_array),
+ *   stored in a single contiguous allocation.
+ *
+ * Both are serialized as MessagePack ext values whose payload is the raw big
+ * endian components, so encoding and decoding them is a bulk copy plus a
+ * bulk byte swap, and decoding never creates a table. */
+
+#define MP_TYPED_ARRAY_FLOAT32  0
+#define MP_TYPED_ARRAY_INT32    1
+
+typedef struct mp_vector {
+    int n;          /* Number of components: 2, 3 or 4. */
+    int frozen;     /* Shared by cache:unpack(), can't be modified. */
+    float v[4];
+} mp_vector;
+
+/* The elements follow the header in the same userdata block. */
+typedef struct mp_typed_array {
+    int type;       /* MP_TYPED_ARRAY_FLOAT32 or MP_TYPED_ARRAY_INT32. */
+    int frozen;     /* Shared by cache:unpack(), can't be modified. */
+    size_t len;     /* Number of elements. */
+} mp_typed_array;
+
+#define mp_typed_array_data(a) ((void*)((a)+1))
+
+/* Return the userdata at index 'ud' if its metatable is 'tname', else NULL.
+ * Same as luaL_testudata() of Lua 5.2, that is missing in 5.1. */
+void *mp_testudata(lua_State *L, int ud, const char *tname) {
+    void *p = lua_touserdata(L, ud);
+
+    if (p == NULL || !lua_getmetatable(L, ud)) return NULL;
+    luaL_getmetatable(L, tname);
+    if (!lua_rawequal(L, -1, -2)) p = NULL;
+    lua_pop(L, 2);
+    return p;
+}
+
+mp_vector *mp_push_vector(lua_State *L, int n) {
+    mp_vector *vec = (mp_vector*)lua_newuserdata(L, sizeof(*vec));
+
+    memset(vec, 0, sizeof(*vec));
+    vec->n = n;
+    luaL_getmetatable(L, LUACMSGPACK_VECTOR_MT);
+    lua_setmetatable(L, -2);
+    return vec;
+}
+
+mp_typed_array *mp_push_typed_array(lua_State *L, int type, size_t len) {
+    mp_typed_array *arr;
+
+    arr = (mp_typed_array*)lua_newuserdata(L, sizeof(*arr) + len*4);
+    arr->type = type;
+    arr->frozen = 0;
+    arr->len = len;
+    memset(mp_typed_array_data(arr), 0, len*4);
+    luaL_getmetatable(L, LUACMSGPACK_TYPED_ARRAY_MT);
+    lua_setmetatable(L, -2);
+    return arr;
+}
+
+/* Make the vector or typed array at index 'idx', if it is one, read-only. */
+void mp_freeze_userdata(lua_State *L, int idx) {
+    mp_vector *vec;
+    mp_typed_array *arr;
+
+    if (lua_type(L, idx) != LUA_TUSERDATA) return;
+    if ((vec = (mp_vector*)mp_testudata(L, idx, LUACMSGPACK_VECTOR_MT)) != NULL)
+        vec->frozen = 1;
+    else if ((arr = (mp_typed_array*)mp_testudata(L, idx, LUACMSGPACK_TYPED_ARRAY_MT)) != NULL)
+        arr->frozen = 1;
+}
+
+void mp_encode_lua_userdata(lua_State *L, mp_buf *buf) {
+    mp_vector *vec;
+    mp_typed_array *arr;
+    unsigned char b[1];
+
+    if ((vec = (mp_vector*)mp_testudata(L, -1, LUACMSGPACK_VECTOR_MT)) != NULL) {
+        mp_encode_ext_header(L, buf, vec->n == 2 ? LUACMSGPACK_EXT_VEC2 :
+            vec->n == 3 ? LUACMSGPACK_EXT_VEC3 : LUACMSGPACK_EXT_VEC4, vec->n*4);
+        mp_buf_append_words32(L, buf, vec->v, vec->n);
+    } else if ((arr = (mp_typed_array*)mp_testudata(L, -1, LUACMSGPACK_TYPED_ARRAY_MT)) != NULL) {
+        mp_encode_ext_header(L, buf, arr->type == MP_TYPED_ARRAY_FLOAT32 ?
+            LUACMSGPACK_EXT_FLOAT32_ARRAY : LUACMSGPACK_EXT_INT32_ARRAY, arr->len*4);
+        mp_buf_append_words32(L, buf, mp_typed_array_data(arr), arr->len);
+    } else {
+        /* Any other userdata is encoded as nil, like every unsupported type. */
+        b[0] = 0xc0;
+        MP_STAT_ADD(buf->stats,encoded[MP_STAT_NIL],1);
+        mp_buf_append(L,buf,b,1);
+    }
+}
+
 /* --------------------------- Lua types encoding --------------------------- */
 
 void mp_encode_lua_string(lua_State *L, mp_buf *buf) {
@@ -348,6 +1088,7 @@ void mp_encode_lua_string(lua_State *L, mp_buf *buf) {
 
 void mp_encode_lua_bool(lua_State *L, mp_buf *buf) {
     unsigned char b = lua_toboolean(L,-1) ? 0xc3 : 0xc2;
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_BOOLEAN],1);
     mp_buf_append(L,buf,&b,1);
 }
 
@@ -375,6 +1116,59 @@ void mp_encode_lua_number(lua_State *L, mp_buf *buf) {
 }
 
 void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level);
+int mp_readonly_newindex(lua_State *L);
+
+/* Number of elements of a numeric array that are written to a stack scratch
+ * buffer before being appended to the output buffer in a single call. */
+#define MP_NUMERIC_BATCH 256
+
+/* Convert a lua table that only contains numbers into a message pack list.
+ * This is the same as mp_encode_lua_table_as_array() but, since the element
+ * type is known, it skips the generic per element dispatch: elements are
+ * fetched with lua_rawgeti(), written with mp_write_int() / mp_write_double()
+ * into a scratch buffer, and appended to 'buf' once per batch. The encoding
+ * decisions are the same of mp_encode_lua_integer() / mp_encode_lua_number(),
+ * so the output is byte for byte the same of the generic path. */
+void mp_encode_lua_numeric_array(lua_State *L, mp_buf *buf, size_t len) {
+    unsigned char out[MP_NUMERIC_BATCH*9];
+    size_t j, k, n;
+
+    mp_encode_array(L,buf,len);
+    if (!lua_checkstack(L, 1)) {
+        buf->err = MP_BUF_ERROR_STACK;
+        return;
+    }
+    for (j = 1; j <= len; j += n) {
+        unsigned char *p = out;
+
+        n = len-j+1;
+        if (n > MP_NUMERIC_BATCH) n = MP_NUMERIC_BATCH;
+        for (k = 0; k < n; k++) {
+            lua_Number num;
+
+            lua_rawgeti(L,-1,(int)(j+k));
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L,-1)) {
+                p += mp_write_int(p,(int64_t)lua_tointeger(L,-1));
+                MP_STAT_ADD(buf->stats,encoded[MP_STAT_INTEGER],1);
+                lua_pop(L,1);
+                continue;
+            }
+#endif
+            num = lua_tonumber(L,-1);
+            if (IS_INT64_EQUIVALENT(num)) {
+                p += mp_write_int(p,(int64_t)num);
+                MP_STAT_ADD(buf->stats,encoded[MP_STAT_INTEGER],1);
+            } else {
+                p += mp_write_double(p,(double)num);
+                MP_STAT_ADD(buf->stats,encoded[MP_STAT_FLOAT],1);
+            }
+            lua_pop(L,1);
+        }
+        mp_buf_append(L,buf,out,p-out);
+        if (buf->err) return;
+    }
+}
 
 /* Convert a lua table into a message pack list. */
 void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level) {
@@ -385,12 +1179,51 @@ void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level) {
 #endif
 
     mp_encode_array(L,buf,len);
-    luaL_checkstack(L, 1, "in function mp_encode_lua_table_as_array");
+    if (!lua_checkstack(L, 1)) {
+        buf->err = MP_BUF_ERROR_STACK;
+        return;
+    }
     for (j = 1; j <= len; j++) {
-        lua_pushnumber(L,j);
-        lua_gettable(L,-2);
+        /* Raw access, as in table_is_an_array(): no metamethod can run (and
+         * raise) while the safe pack() is not in protected mode. */
+        lua_rawgeti(L,-1,(int)j);
         mp_encode_lua_type(L,buf,level+1);
+        if (buf->err) return;
+    }
+}
+
+/* Encode the map key on top of the stack, popping it. When a dictionary is
+ * in use, string keys found in it are replaced by a reference to their
+ * index, a fixext 1 or fixext 2 of type LUACMSGPACK_EXT_KEY, as long as
+ * the reference is shorter than the string itself. */
+void mp_encode_lua_key(lua_State *L, mp_buf *buf, int level) {
+    if (buf->dict && lua_type(L,-1) == LUA_TSTRING) {
+        size_t len, idx;
+        unsigned char b[2];
+
+        lua_tolstring(L,-1,&len);
+        lua_pushvalue(L,-1);
+        lua_rawget(L,buf->dict);
+        if (lua_type(L,-1) == LUA_TNUMBER) {
+            idx = (size_t)lua_tonumber(L,-1);
+            if (idx <= 0xff && len > 2) {
+                b[0] = idx;
+                mp_encode_ext_header(L,buf,LUACMSGPACK_EXT_KEY,1);
+                mp_buf_append(L,buf,b,1);
+                lua_pop(L,2);
+                return;
+            } else if (idx > 0xff && len > 3) {
+                b[0] = (idx >> 8) & 0xff;
+                b[1] = idx & 0xff;
+                mp_encode_ext_header(L,buf,LUACMSGPACK_EXT_KEY,2);
+                mp_buf_append(L,buf,b,2);
+                lua_pop(L,2);
+                return;
+            }
+        }
+        lua_pop(L,1);
     }
+    mp_encode_lua_type(L,buf,level);
 }
 
 /* Convert a lua table into a message pack key-value map. */
@@ -401,7 +1234,10 @@ void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
      * Lua API, we need to iterate a first time. Note that an alternative
      * would be to do a single run, and then hack the buffer to insert the
      * map opcodes for message pack. Too hackish for this lib. */
-    luaL_checkstack(L, 3, "in function mp_encode_lua_table_as_map");
+    if (!lua_checkstack(L, 3)) {
+        buf->err = MP_BUF_ERROR_STACK;
+        return;
+    }
     lua_pushnil(L);
     while(lua_next(L,-2)) {
         lua_pop(L,1); /* remove value, keep key for next iteration. */
@@ -414,16 +1250,21 @@ void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
     while(lua_next(L,-2)) {
         /* Stack: ... key value */
         lua_pushvalue(L,-2); /* Stack: ... key value key */
-        mp_encode_lua_type(L,buf,level+1); /* encode key */
+        mp_encode_lua_key(L,buf,level+1); /* encode key */
         mp_encode_lua_type(L,buf,level+1); /* encode val */
+        if (buf->err) {
+            lua_pop(L,1); /* Stack: ... (table on top as on entry) */
+            return;
+        }
     }
 }
 
 /* Returns true if the Lua table on top of the stack is exclusively composed
  * of keys from numerical keys from 1 up to N, with N being the total number
- * of elements, without any hole in the middle. */
-int table_is_an_array(lua_State *L) {
-    int count = 0, max = 0;
+ * of elements, without any hole in the middle. If 'numeric' is not NULL it
+ * is set to true when, in addition, all the values are numbers. */
+int table_is_an_array(lua_State *L, int *numeric) {
+    int count = 0, max = 0, numbers = 1;
 #if LUA_VERSION_NUM < 503
     lua_Number n;
 #else
@@ -438,6 +1279,7 @@ int table_is_an_array(lua_State *L) {
     lua_pushnil(L);
     while(lua_next(L,-2)) {
         /* Stack: ... key value */
+        if (lua_type(L,-1) != LUA_TNUMBER) numbers = 0;
         lua_pop(L,1); /* Stack: ... key */
         /* The <= 0 check is valid here because we're comparing indexes. */
 #if LUA_VERSION_NUM < 503
@@ -459,23 +1301,64 @@ int table_is_an_array(lua_State *L) {
      * repeated keys into a table, you have that if max==count you are sure
      * that there are all the keys form 1 to count (both included). */
     lua_settop(L, stacktop);
+    if (numeric) *numeric = numbers;
     return max == count;
 }
 
+/* Return true if the value at index 'idx' is a read-only proxy returned by
+ * cache:unpack(). */
+int mp_readonly_is(lua_State *L, int idx) {
+    int ro = 0;
+
+    if (lua_checkstack(L, 2) && lua_getmetatable(L,idx)) {
+        lua_getfield(L,-1,"__newindex");
+        ro = lua_tocfunction(L,-1) == mp_readonly_newindex;
+        lua_pop(L,2);
+    }
+    return ro;
+}
+
+/* Replace the table on top of the stack, if it is a read-only proxy, with
+ * the table it stands for. */
+void mp_readonly_real(lua_State *L) {
+    if (mp_readonly_is(L,-1) && lua_checkstack(L, 2)) {
+        lua_getmetatable(L,-1);
+        lua_getfield(L,-1,"__index");
+        lua_replace(L,-3);
+        lua_pop(L,1);
+    }
+}
+
 /* If the length operator returns non-zero, that is, there is at least
  * an object at key '1', we serialize to message pack list. Otherwise
  * we use a map. */
 void mp_encode_lua_table(lua_State *L, mp_buf *buf, int level) {
-    if (table_is_an_array(L))
-        mp_encode_lua_table_as_array(L,buf,level);
-    else
+    int numeric;
+
+    mp_readonly_real(L);
+    MP_STAT_MAX(buf->stats,max_encode_depth,level+1);
+    if (table_is_an_array(L,&numeric)) {
+        MP_STAT_ADD(buf->stats,tables_as_array,1);
+        if (numeric) {
+#if LUA_VERSION_NUM < 502
+            mp_encode_lua_numeric_array(L,buf,lua_objlen(L,-1));
+#else
+            mp_encode_lua_numeric_array(L,buf,lua_rawlen(L,-1));
+#endif
+        } else {
+            mp_encode_lua_table_as_array(L,buf,level);
+        }
+    } else {
+        MP_STAT_ADD(buf->stats,tables_as_map,1);
         mp_encode_lua_table_as_map(L,buf,level);
+    }
 }
 
 void mp_encode_lua_null(lua_State *L, mp_buf *buf) {
     unsigned char b[1];
 
     b[0] = 0xc0;
+    MP_STAT_ADD(buf->stats,encoded[MP_STAT_NIL],1);
     mp_buf_append(L,buf,b,1);
 }
 
@@ -484,7 +1367,10 @@ void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level) {
 
     /* Limit the encoding of nested tables to a specified maximum depth, so that
      * we survive when called against circular references in tables. */
-    if (t == LUA_TTABLE && level == LUACMSGPACK_MAX_NESTING) t = LUA_TNIL;
+    if (t == LUA_TTABLE && level == LUACMSGPACK_MAX_NESTING) {
+        if (buf->strict_depth) buf->err = MP_BUF_ERROR_DEPTH;
+        t = LUA_TNIL;
+    }
     switch(t) {
     case LUA_TSTRING: mp_encode_lua_string(L,buf); break;
     case LUA_TBOOLEAN: mp_encode_lua_bool(L,buf); break;
@@ -500,11 +1386,24 @@ void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level) {
         break;
     #endif
     case LUA_TTABLE: mp_encode_lua_table(L,buf,level); break;
+    case LUA_TUSERDATA: mp_encode_lua_userdata(L,buf); break;
     default: mp_encode_lua_null(L,buf); break;
     }
     lua_pop(L,1);
 }
 
+/* Free the buffer and report its error with mp_fail(). */
+int mp_buf_error(lua_State *L, mp_buf *buf) {
+    int err = buf->err;
+
+    mp_buf_free(L, buf);
+    lua_settop(L,0); /* Make room for the error. */
+    if (err == MP_BUF_ERROR_DEPTH)
+        return mp_fail(L,"Delta too deep: a table is nested more than %d levels.",
+                       LUACMSGPACK_MAX_NESTING);
+    return mp_fail(L,"Stack overflow while encoding.");
+}
+
 /*
  * Packs all arguments as a stream for multiple upacking later.
  * Returns error if no arguments provided.
@@ -513,23 +1412,27 @@ int mp_pack(lua_State *L) {
     int nargs = lua_gettop(L);
     int i;
     mp_buf *buf;
+#ifdef LUACMSGPACK_STATS
+    uint64_t start = mp_stats_now();
+#endif
 
     if (nargs == 0)
-        return luaL_argerror(L, 0, "MessagePack pack needs input.");
+        return mp_fail_arg(L, 0, "MessagePack pack needs input.");
 
-    if (!lua_checkstack(L, nargs))
-        return luaL_argerror(L, 0, "Too many arguments for MessagePack pack.");
+    if (!lua_checkstack(L, nargs + 1))
+        return mp_fail_arg(L, 0, "Too many arguments for MessagePack pack.");
 
     buf = mp_buf_new(L);
     for(i = 1; i <= nargs; i++) {
         /* Copy argument i to top of stack for _encode processing;
          * the encode function pops it from the stack when complete. */
-        luaL_checkstack(L, 1, "in function mp_check");
         lua_pushvalue(L, i);
 
         mp_encode_lua_type(L,buf,0);
+        if (buf->err) return mp_buf_error(L, buf);
 
         lua_pushlstring(L,(char*)buf->b,buf->len);
+        MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
 
         /* Reuse the buffer for the next operation by
          * setting its free count to the total buffer size
@@ -537,6 +1440,8 @@ int mp_pack(lua_State *L) {
         buf->free += buf->len;
         buf->len = 0;
     }
+    MP_STAT_ADD(buf->stats,pack_calls,1);
+    MP_STAT_ADD(buf->stats,pack_ns,mp_stats_now() - start);
     mp_buf_free(L, buf);
 
     /* Concatenate all nargs buffers together */
@@ -544,50 +1449,364 @@ int mp_pack(lua_State *L) {
     return 1;
 }
 
-/* ------------------------------- Decoding --------------------------------- */
+/* Compute the encoded length of the values at stack indexes 'first' to 'last'
+ * running the encoder against a sizing buffer, so that the result follows
+ * exactly the same decisions about integer widths, float vs double and
+ * arrays vs maps. Returns 0 and leaves *len untouched if the length would
+ * exceed 'limit'. */
+int mp_encoded_size(lua_State *L, int first, int last, size_t limit, size_t *len) {
+    mp_buf buf;
+    int i;
 
-void mp_decode_to_lua_type(lua_State *L, mp_cur *c);
+    mp_buf_init_sizing(&buf, limit);
+    for (i = first; i <= last && !buf.err; i++) {
+        luaL_checkstack(L, 1, "in function mp_encoded_size");
+        lua_pushvalue(L, i);
+        mp_encode_lua_type(L,&buf,0);
+    }
+    if (buf.err == MP_BUF_ERROR_STACK)
+        luaL_error(L,"Stack overflow while encoding.");
+    if (buf.err) return 0;
+    *len = buf.len;
+    return 1;
+}
 
-void mp_decode_to_lua_array(lua_State *L, mp_cur *c, size_t len) {
-    assert(len <= UINT_MAX);
-    int index = 1;
+/* Returns the length of the msgpack stream pack() would produce for the
+ * arguments, without encoding anything. */
+int mp_size(lua_State *L) {
+    int nargs = lua_gettop(L);
+    size_t len = 0;
 
-    lua_newtable(L);
-    luaL_checkstack(L, 1, "in function mp_decode_to_lua_array");
-    while(len--) {
-        lua_pushnumber(L,index++);
+    if (nargs == 0)
+        return luaL_argerror(L, 0, "MessagePack size needs input.");
+
+    mp_encoded_size(L, 1, nargs, SIZE_MAX, &len);
+    lua_pushinteger(L, (lua_Integer)len);
+    return 1;
+}
+
+/* Like size() but the first argument is a maximum: as soon as the encoding
+ * is known to be longer, sizing stops and false is returned. */
+int mp_size_max(lua_State *L) {
+    lua_Number max = luaL_checknumber(L, 1);
+    int nargs = lua_gettop(L);
+    size_t len;
+
+    if (nargs < 2)
+        return luaL_argerror(L, 0, "MessagePack size needs input.");
+    if (max != max) return luaL_argerror(L, 1, "maximum size is NaN");
+    if (max < 0) max = 0;
+
+    if (mp_encoded_size(L, 2, nargs,
+            max >= (lua_Number)SIZE_MAX ? SIZE_MAX : (size_t)max, &len))
+        lua_pushinteger(L, (lua_Integer)len);
+    else
+        lua_pushboolean(L, 0);
+    return 1;
+}
+
+/* Same output as pack(), but sizes the arguments first so that the whole
+ * stream is written into a single allocation of exactly the right size,
+ * instead of growing the buffer and concatenating per-argument strings. */
+int mp_pack_exact(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int i;
+    size_t len = 0;
+    mp_buf *buf;
+
+    if (nargs == 0)
+        return luaL_argerror(L, 0, "MessagePack pack needs input.");
+
+    mp_encoded_size(L, 1, nargs, SIZE_MAX, &len);
+
+    buf = mp_buf_new(L);
+    mp_buf_reserve(L, buf, len);
+    for(i = 1; i <= nargs; i++) {
+        luaL_checkstack(L, 1, "in function mp_pack_exact");
+        lua_pushvalue(L, i);
+        mp_encode_lua_type(L,buf,0);
+    }
+    if (buf->err) return mp_buf_error(L, buf);
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
+    MP_STAT_ADD(buf->stats,pack_calls,1);
+    mp_buf_free(L, buf);
+    return 1;
+}
+
+/* Digest of pack_hashed() / unpack_verified(): XXH64 of the packed data,
+ * as an 8 bytes big endian string. */
+#define MP_DIGEST_LEN 8
+
+void mp_push_digest(lua_State *L, uint64_t digest) {
+    unsigned char b[MP_DIGEST_LEN];
+    int i;
+
+    for (i = 0; i < MP_DIGEST_LEN; i++)
+        b[i] = (digest >> (56 - i*8)) & 0xff;
+    lua_pushlstring(L,(char*)b,MP_DIGEST_LEN);
+}
+
+/* Same output as pack(), plus the digest of the packed data as second
+ * return value. The digest is computed while encoding, a block at a time
+ * as soon as it is written, instead of with a second pass over the result. */
+int mp_pack_hashed(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int i;
+    mp_buf *buf;
+    mp_xxh64 hash;
+
+    if (nargs == 0)
+        return mp_fail_arg(L, 0, "MessagePack pack needs input.");
+    if (!lua_checkstack(L, 1))
+        return mp_fail_arg(L, 0, "Too many arguments for MessagePack pack.");
+
+    mp_xxh64_init(&hash);
+    buf = mp_buf_new(L);
+    buf->hash = &hash;
+    for(i = 1; i <= nargs; i++) {
+        lua_pushvalue(L, i);
+        mp_encode_lua_type(L,buf,0);
+        if (buf->err) return mp_buf_error(L, buf);
+    }
+    mp_buf_hash(buf,1);
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    mp_push_digest(L,mp_xxh64_digest(&hash));
+    MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
+    MP_STAT_ADD(buf->stats,pack_calls,1);
+    mp_buf_free(L, buf);
+    return 2;
+}
+
+/* ------------------------------- Decoding --------------------------------- */
+
+void mp_decode_to_lua_type(lua_State *L, mp_cur *c);
+
+/* Skip the object pointed by the cursor, with everything nested into it,
+ * without decoding anything. Nested objects are just counted, so there is
+ * no recursion whatever the nesting level. */
+void mp_cur_skip(mp_cur *c) {
+    size_t pending = 1;
+
+    while(pending) {
+        size_t hdr = 1, l = 0, n = 0; /* Header len, payload len, children. */
+        unsigned char b;
+
+        mp_cur_need(c,1);
+        b = c->p[0];
+        pending--;
+        if (b <= 0x7f || b >= 0xe0 || b == 0xc0 || b == 0xc2 || b == 0xc3) {
+            /* Fixnums, nil and booleans: just the type byte. */
+        } else if ((b & 0xe0) == 0xa0) {    /* fix raw */
+            l = b & 0x1f;
+        } else if ((b & 0xf0) == 0x90) {    /* fix array */
+            n = b & 0xf;
+        } else if ((b & 0xf0) == 0x80) {    /* fix map */
+            n = (size_t)(b & 0xf) * 2;
+        } else {
+            switch(b) {
+            case 0xcc: case 0xd0: hdr = 2; break;
+            case 0xcd: case 0xd1: hdr = 3; break;
+            case 0xce: case 0xd2: case 0xca: hdr = 5; break;
+            case 0xcf: case 0xd3: case 0xcb: hdr = 9; break;
+            case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                hdr = 2;
+                l = (size_t)1 << (b - 0xd4);
+                break;
+            case 0xd9: case 0xc7:   /* raw 8, ext 8 */
+                hdr = b == 0xd9 ? 2 : 3;
+                mp_cur_need(c,2);
+                l = c->p[1];
+                break;
+            case 0xda: case 0xc8: case 0xdc: case 0xde: /* 16 bit lengths */
+                hdr = b == 0xc8 ? 4 : 3;
+                mp_cur_need(c,3);
+                l = (c->p[1] << 8) | c->p[2];
+                break;
+            case 0xdb: case 0xc9: case 0xdd: case 0xdf: /* 32 bit lengths */
+                hdr = b == 0xc9 ? 6 : 5;
+                mp_cur_need(c,5);
+                l = ((size_t)c->p[1] << 24) |
+                    ((size_t)c->p[2] << 16) |
+                    ((size_t)c->p[3] << 8) |
+                    (size_t)c->p[4];
+                break;
+            default:
+                c->err = MP_CUR_ERROR_BADFMT;
+                return;
+            }
+            /* For containers the length is a count of children. */
+            if (b == 0xdc || b == 0xdd) {
+                n = l;
+                l = 0;
+            } else if (b == 0xde || b == 0xdf) {
+                n = l * 2;
+                l = 0;
+            }
+        }
+        mp_cur_need(c,hdr);
+        mp_cur_consume(c,hdr);
+        mp_cur_need(c,l);
+        mp_cur_consume(c,l);
+        pending += n;
+    }
+}
+
+/* Read a big endian IEEE 754 float / double stored at 'p'. */
+static float mp_read_float(const unsigned char *p) {
+    uint32_t u = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                 ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    float f;
+
+    memcpy(&f,&u,4);
+    return f;
+}
+
+static double mp_read_double(const unsigned char *p) {
+    uint64_t u = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                 ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                 ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                 ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+    double d;
+
+    memcpy(&d,&u,8);
+    return d;
+}
+
+/* True if the value on top of the stack can't be a table key (nil or NaN):
+ * maps with such keys are a format error, as storing them would raise. */
+int mp_invalid_key(lua_State *L) {
+    lua_Number n;
+
+    if (lua_isnil(L,-1)) return 1;
+    if (lua_type(L,-1) != LUA_TNUMBER) return 0;
+    n = lua_tonumber(L,-1);
+    return n != n;
+}
+
+void mp_decode_to_lua_array(lua_State *L, mp_cur *c, size_t len) {
+    assert(len <= UINT_MAX);
+    int index = 1;
+
+    /* After mp_cur_enter() 'len' is known to fit the input, so it is safe
+     * to use it to presize the table. */
+    if (!mp_cur_enter(c,len,1)) return;
+    lua_createtable(L,(int)len,0);
+    if (!lua_checkstack(L, 1)) {
+        c->err = MP_CUR_ERROR_STACK;
+        return;
+    }
+    while(len) {
+        /* Bulk path: a run of floats, doubles or positive fixnums is decoded
+         * in a tight loop without going through mp_decode_to_lua_type(). */
+        unsigned char type = c->left ? c->p[0] : 0xc1;
+        size_t width = type == 0xca ? 5 : (type == 0xcb ? 9 : 1);
+
+        if ((type == 0xca || type == 0xcb) && c->left >= width) {
+            while(len && c->left >= width && c->p[0] == type) {
+                if (type == 0xca)
+                    lua_pushnumber(L,mp_read_float(c->p+1));
+                else
+                    lua_pushnumber(L,mp_read_double(c->p+1));
+                MP_STAT_ADD(c->stats,decoded[MP_STAT_FLOAT],1);
+                mp_cur_consume(c,width);
+                lua_rawseti(L,-2,index++);
+                len--;
+            }
+            continue;
+        } else if (type <= 0x7f) {
+            while(len && c->left && c->p[0] <= 0x7f) {
+                lua_pushunsigned(L,c->p[0]);
+                MP_STAT_ADD(c->stats,decoded[MP_STAT_INTEGER],1);
+                mp_cur_consume(c,1);
+                lua_rawseti(L,-2,index++);
+                len--;
+            }
+            continue;
+        }
         mp_decode_to_lua_type(L,c);
         if (c->err) return;
-        lua_settable(L,-3);
+        lua_rawseti(L,-2,index++);
+        len--;
     }
+    mp_cur_leave(c);
 }
 
 void mp_decode_to_lua_hash(lua_State *L, mp_cur *c, size_t len) {
     assert(len <= UINT_MAX);
+    if (!mp_cur_enter(c,len,2)) return;
     lua_newtable(L);
     while(len--) {
         mp_decode_to_lua_type(L,c); /* key */
         if (c->err) return;
+        if (mp_invalid_key(L)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
         mp_decode_to_lua_type(L,c); /* value */
         if (c->err) return;
-        lua_settable(L,-3);
+        lua_rawset(L,-3);
+    }
+    mp_cur_leave(c);
+}
+
+/* Decode the 'len' bytes ext payload 'p' of the given type. Only the native
+ * vector types and, when decoding with a dictionary, key references are
+ * known: any other extension is a format error. */
+void mp_decode_ext_to_lua(lua_State *L, mp_cur *c, int type, const unsigned char *p, size_t len) {
+    mp_vector *vec;
+    mp_typed_array *arr;
+    int n;
+
+    switch(type) {
+    case LUACMSGPACK_EXT_VEC2:
+    case LUACMSGPACK_EXT_VEC3:
+    case LUACMSGPACK_EXT_VEC4:
+        n = type == LUACMSGPACK_EXT_VEC2 ? 2 : type == LUACMSGPACK_EXT_VEC3 ? 3 : 4;
+        if (len != (size_t)n*4) break;
+        vec = mp_push_vector(L, n);
+        memcpy(vec->v, p, len);
+        memrev32ifle(vec->v, n);
+        return;
+    case LUACMSGPACK_EXT_FLOAT32_ARRAY:
+    case LUACMSGPACK_EXT_INT32_ARRAY:
+        if (len % 4) break;
+        arr = mp_push_typed_array(L, type == LUACMSGPACK_EXT_FLOAT32_ARRAY ?
+            MP_TYPED_ARRAY_FLOAT32 : MP_TYPED_ARRAY_INT32, len/4);
+        memcpy(mp_typed_array_data(arr), p, len);
+        memrev32ifle(mp_typed_array_data(arr), len/4);
+        return;
+    case LUACMSGPACK_EXT_KEY:
+        /* Dictionary keys are interned strings already: no hashing here. */
+        if (!c->dict || (len != 1 && len != 2)) break;
+        lua_rawgeti(L, c->dict, (len == 1 ? p[0] : (p[0] << 8) | p[1]) + 1);
+        if (!lua_isnil(L, -1)) return;
+        lua_pop(L, 1);
+        break;
     }
+    c->err = MP_CUR_ERROR_BADFMT;
 }
 
 /* Decode a Message Pack raw object pointed by the string cursor 'c' to
  * a Lua type, that is left as the only result on the stack. */
 void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
     mp_cur_need(c,1);
+    if (c->hash && (size_t)(c->p - c->hashed) >= MP_HASH_BLOCK)
+        mp_cur_hash(c,0);
 
     /* If we return more than 18 elements, we must resize the stack to
      * fit all our return values.  But, there is no way to
      * determine how many objects a msgpack will unpack to up front, so
      * we request a +1 larger stack on each iteration (noop if stack is
      * big enough, and when stack does require resize it doubles in size) */
-    luaL_checkstack(L, 1,
-        "too many return values at once; "
-        "use unpack_one or unpack_limit instead.");
+    if (!lua_checkstack(L, 1)) {
+        c->err = MP_CUR_ERROR_STACK;
+        return;
+    }
 
+#ifdef LUACMSGPACK_STATS
+    MP_STAT_ADD(c->stats,decoded[mp_stats_classify(c->p[0])],1);
+#endif
     switch(c->p[0]) {
     case 0xcc:  /* uint 8 */
         mp_cur_need(c,2);
@@ -699,6 +1918,7 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
         mp_cur_need(c,2);
         {
             size_t l = c->p[1];
+            mp_cur_need_string(c,l);
             mp_cur_need(c,2+l);
             lua_pushlstring(L,(char*)c->p+2,l);
             mp_cur_consume(c,2+l);
@@ -708,6 +1928,7 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
         mp_cur_need(c,3);
         {
             size_t l = (c->p[1] << 8) | c->p[2];
+            mp_cur_need_string(c,l);
             mp_cur_need(c,3+l);
             lua_pushlstring(L,(char*)c->p+3,l);
             mp_cur_consume(c,3+l);
@@ -720,6 +1941,7 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
                        ((size_t)c->p[2] << 16) |
                        ((size_t)c->p[3] << 8) |
                        (size_t)c->p[4];
+            mp_cur_need_string(c,l);
             mp_cur_consume(c,5);
             mp_cur_need(c,l);
             lua_pushlstring(L,(char*)c->p,l);
@@ -764,6 +1986,54 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
             mp_decode_to_lua_hash(L,c,l);
         }
         break;
+    case 0xd4:  /* fixext 1 */
+    case 0xd5:  /* fixext 2 */
+    case 0xd6:  /* fixext 4 */
+    case 0xd7:  /* fixext 8 */
+    case 0xd8:  /* fixext 16 */
+        {
+            size_t l = (size_t)1 << (c->p[0] - 0xd4);
+            mp_cur_need_string(c,l);
+            mp_cur_need(c,2+l);
+            mp_decode_ext_to_lua(L,c,(signed char)c->p[1],c->p+2,l);
+            mp_cur_consume(c,2+l);
+        }
+        break;
+    case 0xc7:  /* ext 8 */
+        mp_cur_need(c,3);
+        {
+            size_t l = c->p[1];
+            mp_cur_need_string(c,l);
+            mp_cur_need(c,3+l);
+            mp_decode_ext_to_lua(L,c,(signed char)c->p[2],c->p+3,l);
+            mp_cur_consume(c,3+l);
+        }
+        break;
+    case 0xc8:  /* ext 16 */
+        mp_cur_need(c,4);
+        {
+            size_t l = (c->p[1] << 8) | c->p[2];
+            mp_cur_need_string(c,l);
+            mp_cur_need(c,4+l);
+            mp_decode_ext_to_lua(L,c,(signed char)c->p[3],c->p+4,l);
+            mp_cur_consume(c,4+l);
+        }
+        break;
+    case 0xc9:  /* ext 32 */
+        mp_cur_need(c,6);
+        {
+            size_t l = ((size_t)c->p[1] << 24) |
+                       ((size_t)c->p[2] << 16) |
+                       ((size_t)c->p[3] << 8) |
+                       (size_t)c->p[4];
+            int type = (signed char)c->p[5];
+            mp_cur_need_string(c,l);
+            mp_cur_consume(c,6);
+            mp_cur_need(c,l);
+            mp_decode_ext_to_lua(L,c,type,c->p,l);
+            mp_cur_consume(c,l);
+        }
+        break;
     default:    /* types that can't be idenitified by first byte value. */
         if ((c->p[0] & 0x80) == 0) {   /* positive fixnum */
             lua_pushunsigned(L,c->p[0]);
@@ -773,6 +2043,7 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
             mp_cur_consume(c,1);
         } else if ((c->p[0] & 0xe0) == 0xa0) {  /* fix raw */
             size_t l = c->p[0] & 0x1f;
+            mp_cur_need_string(c,l);
             mp_cur_need(c,1+l);
             lua_pushlstring(L,(char*)c->p+1,l);
             mp_cur_consume(c,1+l);
@@ -790,38 +2061,282 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
     }
 }
 
-int mp_unpack_full(lua_State *L, int limit, int offset) {
+/* ------------------------- Decoding into a target -------------------------
+ * The following functions decode into tables that already exist instead of
+ * creating new ones: fields are overwritten in place, nested tables found
+ * under the same key are reused for nested arrays and maps, and keys that
+ * are not in the input are removed. With a steady flow of messages of the
+ * same shape nothing needs to be allocated at all (except new strings).
+ *
+ * Detecting stale keys costs an extra lua_next() walk of the table; only if
+ * it finds more keys than the ones just written the (slower, allocating)
+ * removal is performed. Since the walk compares counts, maps with duplicated
+ * keys in the input may keep stale keys. */
+
+#define MP_CONTAINER_NONE   0
+#define MP_CONTAINER_ARRAY  1
+#define MP_CONTAINER_MAP    2
+
+/* If the cursor points to an array or map, consume the header, store the
+ * number of elements into *len and return the container type. Otherwise
+ * (or if the header is truncated) the cursor is left untouched. */
+int mp_cur_container(mp_cur *c, size_t *len) {
+    unsigned char b;
+
+    if (c->left < 1) return MP_CONTAINER_NONE;
+    b = c->p[0];
+    if ((b & 0xe0) == 0x80) {   /* fix map or fix array */
+        *len = b & 0xf;
+        mp_cur_consume(c,1);
+        return (b & 0xf0) == 0x90 ? MP_CONTAINER_ARRAY : MP_CONTAINER_MAP;
+    } else if ((b == 0xdc || b == 0xde) && c->left >= 3) {
+        *len = (c->p[1] << 8) | c->p[2];
+        mp_cur_consume(c,3);
+        return b == 0xdc ? MP_CONTAINER_ARRAY : MP_CONTAINER_MAP;
+    } else if ((b == 0xdd || b == 0xdf) && c->left >= 5) {
+        *len = ((size_t)c->p[1] << 24) |
+               ((size_t)c->p[2] << 16) |
+               ((size_t)c->p[3] << 8) |
+               (size_t)c->p[4];
+        mp_cur_consume(c,5);
+        return b == 0xdd ? MP_CONTAINER_ARRAY : MP_CONTAINER_MAP;
+    }
+    return MP_CONTAINER_NONE;
+}
+
+/* If the cursor points to an ext value, return the length of its header and
+ * store the ext type into *type and the payload length into *len, else (or
+ * if the header is truncated) return 0. The cursor is not moved. */
+size_t mp_cur_ext_header(mp_cur *c, int *type, size_t *len) {
+    const unsigned char *p = c->p;
+
+    if (c->left >= 2 && p[0] >= 0xd4 && p[0] <= 0xd8) {  /* fixext */
+        *type = (signed char)p[1];
+        *len = (size_t)1 << (p[0] - 0xd4);
+        return 2;
+    } else if (c->left >= 3 && p[0] == 0xc7) {          /* ext 8 */
+        *type = (signed char)p[2];
+        *len = p[1];
+        return 3;
+    } else if (c->left >= 4 && p[0] == 0xc8) {          /* ext 16 */
+        *type = (signed char)p[3];
+        *len = (p[1] << 8) | p[2];
+        return 4;
+    } else if (c->left >= 6 && p[0] == 0xc9) {          /* ext 32 */
+        *type = (signed char)p[5];
+        *len = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) |
+               ((size_t)p[3] << 8) | (size_t)p[4];
+        return 6;
+    }
+    return 0;
+}
+
+/* Number of keys of the table on top of the stack. */
+size_t mp_table_count(lua_State *L) {
+    size_t count = 0;
+
+    lua_pushnil(L);
+    while(lua_next(L,-2)) {
+        lua_pop(L,1);
+        count++;
+    }
+    return count;
+}
+
+/* Remove the key on top of the stack from the table just below it,
+ * leaving the key in place for lua_next(). */
+void mp_table_remove_key(lua_State *L) {
+    lua_pushvalue(L,-1);
+    lua_pushnil(L);
+    lua_rawset(L,-4);
+}
+
+void mp_decode_into_lua_type(lua_State *L, mp_cur *c);
+
+/* Fill the table on top of the stack with 'len' array elements. */
+void mp_decode_into_lua_array(lua_State *L, mp_cur *c, size_t len) {
+    size_t i, written = 0;
+
+    if (!mp_cur_enter(c,len,1)) return;
+    if (!lua_checkstack(L, 2)) {
+        c->err = MP_CUR_ERROR_STACK;
+        return;
+    }
+    for (i = 1; i <= len; i++) {
+        lua_rawgeti(L,-1,i); /* Previous value, maybe a table to reuse. */
+        mp_decode_into_lua_type(L,c);
+        if (c->err) return;
+        if (!lua_isnil(L,-1)) written++;
+        lua_rawseti(L,-2,i);
+    }
+    mp_cur_leave(c);
+
+    if (mp_table_count(L) == written) return;
+    /* Stale keys: everything that is not an index from 1 to len. */
+    lua_pushnil(L);
+    while(lua_next(L,-2)) {
+        lua_Number n;
+
+        lua_pop(L,1);
+        if (lua_type(L,-1) != LUA_TNUMBER || (n = lua_tonumber(L,-1)) < 1 ||
+            n > (lua_Number)len || n != floor(n))
+            mp_table_remove_key(L);
+    }
+}
+
+/* Fill the table on top of the stack with 'len' key/value pairs. */
+void mp_decode_into_lua_hash(lua_State *L, mp_cur *c, size_t len) {
+    mp_cur start = *c;
+    size_t i, written = 0;
+
+    if (!mp_cur_enter(c,len,2)) return;
+    if (!lua_checkstack(L, 3)) {
+        c->err = MP_CUR_ERROR_STACK;
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        mp_decode_to_lua_type(L,c); /* key */
+        if (c->err) return;
+        if (mp_invalid_key(L)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        lua_pushvalue(L,-1);
+        lua_rawget(L,-3); /* Previous value, maybe a table to reuse. */
+        mp_decode_into_lua_type(L,c); /* value */
+        if (c->err) return;
+        if (!lua_isnil(L,-1)) written++;
+        lua_rawset(L,-3);
+    }
+    mp_cur_leave(c);
+
+    if (mp_table_count(L) == written) return;
+    /* Stale keys: collect the keys of the input walking it again, then
+     * remove every key of the table that is not among them. */
+    lua_createtable(L,0,(int)len);
+    for (i = 0; i < len; i++) {
+        mp_decode_to_lua_type(L,&start);
+        lua_pushboolean(L,1);
+        lua_rawset(L,-3);
+        mp_cur_skip(&start);
+    }
+    lua_insert(L,-2); /* Stack: ... seen table */
+    lua_pushnil(L);
+    while(lua_next(L,-2)) {
+        lua_pop(L,1);
+        lua_pushvalue(L,-1);
+        lua_rawget(L,-4);
+        if (lua_isnil(L,-1)) {
+            lua_pop(L,1);
+            mp_table_remove_key(L);
+        } else {
+            lua_pop(L,1);
+        }
+    }
+    lua_insert(L,-2); /* Stack: ... table seen */
+    lua_pop(L,1);
+}
+
+/* Like mp_decode_to_lua_type() but the previous value is expected on top of
+ * the stack, and is replaced by the decoded one: if both are tables the old
+ * table is filled in place instead of creating a new one. Read-only proxies
+ * are shared with other holders, so they are replaced instead. */
+void mp_decode_into_lua_type(lua_State *L, mp_cur *c) {
+    size_t len;
+    int type;
+
+    if (lua_type(L,-1) == LUA_TTABLE && !mp_readonly_is(L,-1) &&
+        (type = mp_cur_container(c,&len)) != MP_CONTAINER_NONE)
+    {
+        MP_STAT_ADD(c->stats,decoded[type == MP_CONTAINER_ARRAY ?
+                    MP_STAT_ARRAY : MP_STAT_MAP],1);
+        if (type == MP_CONTAINER_ARRAY)
+            mp_decode_into_lua_array(L,c,len);
+        else
+            mp_decode_into_lua_hash(L,c,len);
+        return;
+    }
+    lua_pop(L,1);
+    mp_decode_to_lua_type(L,c);
+}
+
+/* ---------------------------- Decoding limits -----------------------------
+ * Limits are given as a table with the optional fields max_bytes,
+ * max_objects, max_container, max_string and max_depth, either to a single
+ * unpack call or once to cmsgpack.decoder(). */
+
+#define LUACMSGPACK_DECODER_MT "cmsgpack.decoder"
+
+/* Fill 'lim' from the limits table at index 'idx', that may be nil or none
+ * to mean no limits at all. Returns 0, or the result of mp_fail() if the
+ * table is not valid. */
+int mp_check_limits(lua_State *L, int idx, mp_limits *lim) {
+    static const char *names[] = {"max_bytes", "max_objects", "max_container",
+                                  "max_string", "max_depth"};
+    size_t *fields[5];
+    int i;
+
+    fields[0] = &lim->max_bytes;
+    fields[1] = &lim->max_objects;
+    fields[2] = &lim->max_container;
+    fields[3] = &lim->max_string;
+    fields[4] = &lim->max_depth;
+    *lim = mp_no_limits;
+    if (lua_isnoneornil(L,idx)) return 0;
+    if (!lua_istable(L,idx)) return mp_fail_type(L,idx,"table");
+    for (i = 0; i < 5; i++) {
+        lua_Number n;
+
+        lua_getfield(L,idx,names[i]);
+        n = lua_tonumber(L,-1);
+        if (!lua_isnil(L,-1) && (!lua_isnumber(L,-1) || !(n >= 0))) /* NaN too. */
+            return mp_fail(L,"Limit '%s' must be a non negative number.",names[i]);
+        *fields[i] = n >= (lua_Number)SIZE_MAX ? SIZE_MAX : (size_t)n;
+        lua_pop(L,1);
+    }
+    return 0;
+}
+
+int mp_unpack_full(lua_State *L, int limit, int offset, const mp_limits *limits) {
     size_t len;
     const char *s;
     mp_cur c;
     int cnt; /* Number of objects unpacked */
     int decode_all = (!limit && !offset);
+#ifdef LUACMSGPACK_STATS
+    uint64_t start = mp_stats_now();
+#endif
 
-    s = luaL_checklstring(L,1,&len); /* if no match, exits */
+    if (!lua_isstring(L,1)) return mp_fail_type(L,1,"string");
+    s = lua_tolstring(L,1,&len);
 
     if (offset < 0 || limit < 0) /* requesting negative off or lim is invalid */
-        return luaL_error(L,
+        return mp_fail(L,
             "Invalid request to unpack with offset of %d and limit of %d.",
             offset, len);
     else if (offset > len)
-        return luaL_error(L,
+        return mp_fail(L,
             "Start offset %d greater than input length %d.", offset, len);
 
     if (decode_all) limit = INT_MAX;
 
     mp_cur_init(&c,(const unsigned char *)s+offset,len-offset);
+    c.limits = limits;
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    if (limits->max_bytes && c.left > limits->max_bytes)
+        return mp_fail(L,"Input exceeds the decoding limits.");
 
     /* We loop over the decode because this could be a stream
      * of multiple top-level values serialized together */
     for(cnt = 0; c.left > 0 && cnt < limit; cnt++) {
-        mp_decode_to_lua_type(L,&c);
-
-        if (c.err == MP_CUR_ERROR_EOF) {
-            return luaL_error(L,"Missing bytes in input.");
-        } else if (c.err == MP_CUR_ERROR_BADFMT) {
-            return luaL_error(L,"Bad data format in input.");
-        }
+        if (mp_cur_count(&c)) mp_decode_to_lua_type(L,&c);
+        if (c.err) return mp_cur_error(L,&c);
     }
+    MP_STAT_ADD(c.stats,bytes_decoded,len - offset - c.left);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    MP_STAT_ADD(c.stats,unpack_ns,mp_stats_now() - start);
 
     if (!decode_all) {
         /* c->left is the remaining size of the input buffer.
@@ -829,7 +2344,10 @@ int mp_unpack_full(lua_State *L, int limit, int offset) {
          * to get our next start offset */
         int offset = len - c.left;
 
-        luaL_checkstack(L, 1, "in function mp_unpack_full");
+        if (!lua_checkstack(L, 1)) {
+            c.err = MP_CUR_ERROR_STACK;
+            return mp_cur_error(L,&c);
+        }
 
         /* Return offset -1 when we have have processed the entire buffer. */
         lua_pushinteger(L, c.left == 0 ? -1 : offset);
@@ -847,63 +2365,2173 @@ int mp_unpack_full(lua_State *L, int limit, int offset) {
 }
 
 int mp_unpack(lua_State *L) {
-    return mp_unpack_full(L, 0, 0);
+    mp_limits limits;
+    int err;
+
+    if ((err = mp_check_limits(L, 2, &limits))) return err;
+    lua_settop(L, 1);
+    return mp_unpack_full(L, 0, 0, &limits);
 }
 
-int mp_unpack_one(lua_State *L) {
-    int offset = luaL_optinteger(L, 2, 0);
+/* Decode the first object of the input into the table given as second
+ * argument, reusing it (and its nested tables) as much as possible.
+ * Returns the decoded object: the target table itself, unless the input
+ * is not an array or map. */
+int mp_unpack_into_limits(lua_State *L, const mp_limits *limits) {
+    size_t len;
+    const char *s;
+    mp_cur c;
+
+    if (!lua_isstring(L,1)) return mp_fail_type(L,1,"string");
+    if (!lua_istable(L,2)) return mp_fail_type(L,2,"table");
+    if (mp_readonly_is(L,2))
+        return mp_fail_arg(L,2,"read-only table");
+    s = lua_tolstring(L,1,&len);
+    lua_settop(L,2);
+
+    mp_cur_init(&c,(const unsigned char *)s,len);
+    c.limits = limits;
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    if (limits->max_bytes && len > limits->max_bytes)
+        return mp_fail(L,"Input exceeds the decoding limits.");
+    if (mp_cur_count(&c)) mp_decode_into_lua_type(L,&c);
+    if (c.err) return mp_cur_error(L,&c);
+    MP_STAT_ADD(c.stats,bytes_decoded,len - c.left);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    return 1;
+}
+
+int mp_unpack_into(lua_State *L) {
+    mp_limits limits;
+    int err;
+
+    if ((err = mp_check_limits(L, 3, &limits))) return err;
+    return mp_unpack_into_limits(L, &limits);
+}
+
+int mp_unpack_one_limits(lua_State *L, const mp_limits *limits) {
+    lua_Integer offset;
+    int err;
+
+    if ((err = mp_opt_integer(L, 2, 0, &offset))) return err;
     /* Variable pop because offset may not exist */
     lua_pop(L, lua_gettop(L)-1);
-    return mp_unpack_full(L, 1, offset);
+    return mp_unpack_full(L, 1, (int)offset, limits);
 }
 
-int mp_unpack_limit(lua_State *L) {
-    int limit = luaL_checkinteger(L, 2);
-    int offset = luaL_optinteger(L, 3, 0);
+int mp_unpack_one(lua_State *L) {
+    mp_limits limits;
+    int err;
+
+    if ((err = mp_check_limits(L, 3, &limits))) return err;
+    return mp_unpack_one_limits(L, &limits);
+}
+
+int mp_unpack_limit_limits(lua_State *L, const mp_limits *limits) {
+    lua_Integer limit, offset;
+    int err;
+
+    if (lua_isnoneornil(L, 2)) return mp_fail_type(L, 2, "number");
+    if ((err = mp_opt_integer(L, 2, 0, &limit)) ||
+        (err = mp_opt_integer(L, 3, 0, &offset)))
+        return err;
     /* Variable pop because offset may not exist */
     lua_pop(L, lua_gettop(L)-1);
 
-    return mp_unpack_full(L, limit, offset);
+    return mp_unpack_full(L, (int)limit, (int)offset, limits);
 }
 
-int mp_safe(lua_State *L) {
-    int argc, err, total_results;
+int mp_unpack_limit(lua_State *L) {
+    mp_limits limits;
+    int err;
 
-    argc = lua_gettop(L);
+    if ((err = mp_check_limits(L, 4, &limits))) return err;
+    return mp_unpack_limit_limits(L, &limits);
+}
 
-    /* This adds our function to the bottom of the stack
-     * (the "call this function" position) */
-    lua_pushvalue(L, lua_upvalueindex(1));
-    lua_insert(L, 1);
+/* Unpack all the objects of data followed by its digest, as produced by
+ * concatenating the two results of pack_hashed(). The digest of the data is
+ * computed while decoding and an error is raised if it does not match. */
+int mp_unpack_verified(lua_State *L) {
+    size_t len;
+    const unsigned char *s;
+    mp_cur c;
+    mp_limits limits;
+    mp_xxh64 hash;
+    uint64_t digest;
+    int cnt, i, err;
 
-    err = lua_pcall(L, argc, LUA_MULTRET, 0);
-    total_results = lua_gettop(L);
+    if (!lua_isstring(L,1)) return mp_fail_type(L,1,"string");
+    if ((err = mp_check_limits(L,2,&limits))) return err;
+    s = (const unsigned char*)lua_tolstring(L,1,&len);
+    lua_settop(L,1);
+    if (len < MP_DIGEST_LEN)
+        return mp_fail(L,"Missing bytes in input.");
+    len -= MP_DIGEST_LEN;
+    if (limits.max_bytes && len > limits.max_bytes)
+        return mp_fail(L,"Input exceeds the decoding limits.");
 
-    if (!err) {
-        return total_results;
-    } else {
-        lua_pushnil(L);
-        lua_insert(L,-2);
-        return 2;
+    mp_xxh64_init(&hash);
+    mp_cur_init(&c,s,len);
+    c.limits = &limits;
+    c.hash = &hash;
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    for(cnt = 0; c.left > 0; cnt++) {
+        if (mp_cur_count(&c)) mp_decode_to_lua_type(L,&c);
+        if (c.err) return mp_cur_error(L,&c);
     }
+    mp_cur_hash(&c,1);
+    digest = mp_xxh64_digest(&hash);
+    for (i = 0; i < MP_DIGEST_LEN; i++) {
+        if (s[len+i] != ((digest >> (56 - i*8)) & 0xff))
+            return mp_fail(L,"Digest mismatch in input.");
+    }
+    MP_STAT_ADD(c.stats,bytes_decoded,len);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    return cnt;
 }
 
-/* -------------------------------------------------------------------------- */
-const struct luaL_Reg cmds[] = {
-    {"pack", mp_pack},
-    {"unpack", mp_unpack},
-    {"unpack_one", mp_unpack_one},
-    {"unpack_limit", mp_unpack_limit},
-    {0}
-};
+/* cmsgpack.decoder(limits) returns an object with the unpack, unpack_one,
+ * unpack_limit and unpack_into methods, that take the same arguments of
+ * the module functions and always apply the limits given on creation. */
+int mp_decoder_new(lua_State *L) {
+    mp_limits *limits;
 
-int luaopen_create(lua_State *L) {
-    int i;
-    /* Manually construct our module table instead of
-     * relying on _register or _newlib */
-    lua_newtable(L);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    limits = (mp_limits*)lua_newuserdata(L, sizeof(*limits));
+    mp_check_limits(L, 1, limits); /* Raises on invalid limits. */
+    luaL_getmetatable(L, LUACMSGPACK_DECODER_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
 
-    for (i = 0; i < (sizeof(cmds)/sizeof(*cmds) - 1); i++) {
+/* Copy the limits of the decoder at index 1 and remove it, so that the
+ * arguments are where the module functions expect them. */
+void mp_decoder_self(lua_State *L, mp_limits *limits) {
+    *limits = *(mp_limits*)luaL_checkudata(L, 1, LUACMSGPACK_DECODER_MT);
+    lua_remove(L, 1);
+}
+
+int mp_decoder_unpack(lua_State *L) {
+    mp_limits limits;
+
+    mp_decoder_self(L, &limits);
+    lua_settop(L, 1);
+    return mp_unpack_full(L, 0, 0, &limits);
+}
+
+int mp_decoder_unpack_one(lua_State *L) {
+    mp_limits limits;
+
+    mp_decoder_self(L, &limits);
+    return mp_unpack_one_limits(L, &limits);
+}
+
+int mp_decoder_unpack_limit(lua_State *L) {
+    mp_limits limits;
+
+    mp_decoder_self(L, &limits);
+    return mp_unpack_limit_limits(L, &limits);
+}
+
+int mp_decoder_unpack_into(lua_State *L) {
+    mp_limits limits;
+
+    mp_decoder_self(L, &limits);
+    return mp_unpack_into_limits(L, &limits);
+}
+
+const struct luaL_Reg decoder_methods[] = {
+    {"unpack", mp_decoder_unpack},
+    {"unpack_one", mp_decoder_unpack_one},
+    {"unpack_limit", mp_decoder_unpack_limit},
+    {"unpack_into", mp_decoder_unpack_into},
+    {0}
+};
+
+/* ----------------------------- Delta encoding -----------------------------
+ * pack_delta(old, new) encodes the changes needed to turn the table 'old'
+ * into 'new' as a MessagePack map with an entry for every changed key:
+ *
+ *  - Added or changed keys are mapped to the new value, encoded as usual.
+ *  - Removed keys are mapped to nil (a table can't hold nil values).
+ *  - Keys holding a table in both 'old' and 'new' are mapped to the patch of
+ *    the nested table, wrapped in a LUACMSGPACK_EXT_DELTA ext value so that
+ *    it is not mistaken for a new table. Unchanged nested tables are omitted.
+ *
+ * Values are compared with lua_rawequal(), so userdata and tables are
+ * compared by reference (but tables are then diffed recursively). Since map
+ * and ext headers contain the length of what follows, they are appended after
+ * the entries and then moved in front of them, instead of encoding the
+ * entries into temporary buffers. */
+
+/* Move the 'len' bytes just appended to the buffer to offset 'start',
+ * shifting forward the data in between. Used to prepend headers that can
+ * only be encoded after what they precede. */
+void mp_buf_move_tail(mp_buf *buf, size_t start, size_t len) {
+    unsigned char tail[6];
+
+    assert(len <= sizeof(tail));
+    memcpy(tail,buf->b+buf->len-len,len);
+    memmove(buf->b+start+len,buf->b+start,buf->len-len-start);
+    memcpy(buf->b+start,tail,len);
+}
+
+/* Forget everything appended to the buffer after offset 'start'. */
+void mp_buf_truncate(mp_buf *buf, size_t start) {
+    buf->free += buf->len - start;
+    buf->len = start;
+}
+
+/* Encode the patch from the table at index 'oidx' to the table on top of the
+ * stack, that is popped. Returns the number of entries of the patch.
+ * A table at LUACMSGPACK_MAX_NESTING levels can't be encoded (it would be
+ * nil, that is a removed key): the caller sets 'strict_depth' so that the
+ * buffer error is set to MP_BUF_ERROR_DEPTH instead. */
+size_t mp_encode_lua_delta(lua_State *L, mp_buf *buf, int oidx, int level) {
+    size_t start = buf->len, count = 0, entry, len;
+    int nidx = lua_gettop(L);
+
+    luaL_checkstack(L, 4, "in function mp_encode_lua_delta");
+    /* Read-only proxies are walked through the tables they stand for. */
+    mp_readonly_real(L);
+    lua_pushvalue(L,oidx);
+    mp_readonly_real(L);
+    lua_replace(L,oidx);
+    lua_pushnil(L);
+    while(lua_next(L,nidx)) {
+        /* Stack: ... key value */
+        entry = buf->len;
+        lua_pushvalue(L,-2);
+        mp_encode_lua_type(L,buf,level+1); /* encode key */
+        lua_pushvalue(L,-2);
+        lua_rawget(L,oidx); /* Stack: ... key value oldvalue */
+        if (lua_type(L,-1) == LUA_TTABLE && lua_type(L,-2) == LUA_TTABLE &&
+            level+1 < LUACMSGPACK_MAX_NESTING)
+        {
+            size_t inner;
+
+            lua_insert(L,-2); /* Stack: ... key oldvalue value */
+            inner = buf->len;
+            if (mp_encode_lua_delta(L,buf,lua_gettop(L)-1,level+1) == 0) {
+                if (buf->err) {
+                    lua_settop(L,nidx-1);
+                    return 0;
+                }
+                mp_buf_truncate(buf,entry);
+            } else {
+                len = buf->len;
+                mp_encode_ext_header(L,buf,LUACMSGPACK_EXT_DELTA,len-inner);
+                mp_buf_move_tail(buf,inner,buf->len-len);
+                count++;
+            }
+        } else if (!lua_rawequal(L,-1,-2)) {
+            lua_pop(L,1);
+            lua_pushvalue(L,-1);
+            mp_encode_lua_type(L,buf,level+1); /* encode new value */
+            count++;
+        } else {
+            lua_pop(L,1);
+            mp_buf_truncate(buf,entry);
+        }
+        lua_pop(L,1); /* Stack: ... key */
+    }
+
+    /* Removed keys. */
+    lua_pushnil(L);
+    while(lua_next(L,oidx)) {
+        lua_pop(L,1);
+        lua_pushvalue(L,-1);
+        lua_rawget(L,nidx);
+        if (lua_isnil(L,-1)) {
+            lua_pushvalue(L,-2); /* Stack: ... key nil key */
+            mp_encode_lua_type(L,buf,level+1);
+            mp_encode_lua_type(L,buf,level+1);
+            count++;
+        } else {
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,1);
+
+    if (count) {
+        len = buf->len;
+        mp_encode_map(L,buf,count);
+        mp_buf_move_tail(buf,start,buf->len-len);
+    }
+    return count;
+}
+
+int mp_pack_delta(lua_State *L) {
+    mp_buf *buf;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_settop(L,2);
+
+    buf = mp_buf_new(L);
+    buf->strict_depth = 1;
+    if (mp_encode_lua_delta(L,buf,1,0) == 0) mp_encode_map(L,buf,0);
+    if (buf->err) return mp_buf_error(L, buf);
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
+    MP_STAT_ADD(buf->stats,pack_calls,1);
+    mp_buf_free(L, buf);
+    return 1;
+}
+
+/* Apply the patch pointed by the cursor to the table on top of the stack. */
+void mp_decode_delta(lua_State *L, mp_cur *c) {
+    size_t len, hdr, plen;
+    int type;
+
+    if (mp_cur_container(c,&len) != MP_CONTAINER_MAP) {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    if (!mp_cur_enter(c,len,2)) return;
+    luaL_checkstack(L, 3, "in function mp_decode_delta");
+    while(len--) {
+        mp_decode_to_lua_type(L,c); /* key */
+        if (c->err) return;
+        if (lua_isnil(L,-1)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        if ((hdr = mp_cur_ext_header(c,&type,&plen)) != 0 &&
+            type == LUACMSGPACK_EXT_DELTA)
+        {
+            mp_cur nested;
+
+            mp_cur_consume(c,hdr);
+            mp_cur_need(c,plen);
+            /* Patch the nested table, creating it if needed. */
+            lua_pushvalue(L,-1);
+            lua_rawget(L,-3);
+            if (mp_readonly_is(L,-1)) {
+                c->err = MP_CUR_ERROR_READONLY;
+                return;
+            }
+            if (lua_type(L,-1) != LUA_TTABLE) {
+                lua_pop(L,1);
+                lua_newtable(L);
+                lua_pushvalue(L,-2);
+                lua_pushvalue(L,-2);
+                lua_rawset(L,-5);
+            }
+            nested = *c;
+            nested.left = plen;
+            mp_decode_delta(L,&nested);
+            if (nested.err == MP_CUR_ERROR_NONE && nested.left != 0)
+                nested.err = MP_CUR_ERROR_BADFMT;
+            c->err = nested.err;
+            c->objects = nested.objects;
+            if (c->err) return;
+            mp_cur_consume(c,plen);
+            lua_pop(L,2);
+        } else {
+            mp_decode_to_lua_type(L,c); /* value, nil removes the key */
+            if (c->err) return;
+            lua_rawset(L,-3);
+        }
+    }
+    mp_cur_leave(c);
+}
+
+/* Apply to 'target' the patch produced by pack_delta(), in place. Returns
+ * 'target'. */
+int mp_apply_delta(lua_State *L) {
+    size_t len;
+    const char *s;
+    mp_cur c;
+    mp_limits limits;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    if (mp_readonly_is(L,1)) return luaL_argerror(L,1,"read-only table");
+    s = luaL_checklstring(L,2,&len);
+    mp_check_limits(L,3,&limits); /* Raises on invalid limits. */
+    lua_settop(L,1);
+    if (limits.max_bytes && len > limits.max_bytes)
+        return luaL_error(L,"Input exceeds the decoding limits.");
+
+    mp_cur_init(&c,(const unsigned char *)s,len);
+    c.limits = &limits;
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    if (mp_cur_count(&c)) mp_decode_delta(L,&c);
+    if (c.err == MP_CUR_ERROR_NONE && c.left != 0)
+        c.err = MP_CUR_ERROR_BADFMT;
+    if (c.err) return mp_cur_error(L,&c);
+    MP_STAT_ADD(c.stats,bytes_decoded,len);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    lua_settop(L,1);
+    return 1;
+}
+
+/* ---------------------------- Key dictionaries ----------------------------
+ * new_dictionary{key1, key2, ...} returns an object whose pack and unpack
+ * methods replace the string map keys found in the list with references to
+ * their index (see mp_encode_lua_key()). Both peers must use the same list,
+ * in the same order; keys that are not in the list are encoded as usual, so
+ * a list can be extended at the end while old peers still understand the
+ * keys they don't know yet. The object is a table holding at index 1 the
+ * list of keys, used by the decoder, and at index 2 the key -> index table,
+ * used by the encoder. */
+
+int mp_dictionary_new(lua_State *L) {
+    size_t len, i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+#if LUA_VERSION_NUM < 502
+    len = lua_objlen(L, 1);
+#else
+    len = lua_rawlen(L, 1);
+#endif
+    if (len > LUACMSGPACK_MAX_DICTIONARY)
+        return luaL_argerror(L, 1, "too many keys for a dictionary");
+
+    lua_createtable(L, 2, 0);
+    lua_createtable(L, (int)len, 0);
+    lua_createtable(L, 0, (int)len);
+    for (i = 1; i <= len; i++) {
+        lua_rawgeti(L, 1, (int)i);
+        if (lua_type(L, -1) != LUA_TSTRING)
+            return luaL_argerror(L, 1, "dictionary keys must be strings");
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (!lua_isnil(L, -1))
+            return luaL_argerror(L, 1, "duplicated key in dictionary");
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -4, (int)i);
+        lua_pushnumber(L, (lua_Number)(i-1));
+        lua_rawset(L, -3);
+    }
+    lua_rawseti(L, 2, 2);
+    lua_rawseti(L, 2, 1);
+    luaL_getmetatable(L, LUACMSGPACK_DICTIONARY_MT);
+    lua_setmetatable(L, 2);
+    return 1;
+}
+
+/* Replace the dictionary at index 1 with its table at index 'field'. */
+void mp_dictionary_self(lua_State *L, int field) {
+    if (!lua_istable(L, 1) || !lua_getmetatable(L, 1))
+        luaL_argerror(L, 1, LUACMSGPACK_DICTIONARY_MT " expected");
+    luaL_getmetatable(L, LUACMSGPACK_DICTIONARY_MT);
+    if (!lua_rawequal(L, -1, -2))
+        luaL_argerror(L, 1, LUACMSGPACK_DICTIONARY_MT " expected");
+    lua_pop(L, 2);
+    lua_rawgeti(L, 1, field);
+    lua_replace(L, 1);
+}
+
+/* dictionary:pack(...), same output as pack() but with key references. */
+int mp_dictionary_pack(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int i;
+    mp_buf *buf;
+
+    if (nargs < 2)
+        return luaL_argerror(L, 0, "MessagePack pack needs input.");
+    mp_dictionary_self(L, 2);
+
+    buf = mp_buf_new(L);
+    buf->dict = 1;
+    for(i = 2; i <= nargs; i++) {
+        luaL_checkstack(L, 1, "in function mp_dictionary_pack");
+        lua_pushvalue(L, i);
+        mp_encode_lua_type(L,buf,0);
+    }
+    if (buf->err) return mp_buf_error(L, buf);
+    lua_pushlstring(L,(char*)buf->b,buf->len);
+    MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
+    MP_STAT_ADD(buf->stats,pack_calls,1);
+    mp_buf_free(L, buf);
+    return 1;
+}
+
+/* dictionary:unpack(msgpack [, limits]), the same as unpack() but expanding
+ * key references. */
+int mp_dictionary_unpack(lua_State *L) {
+    size_t len;
+    const char *s;
+    mp_cur c;
+    mp_limits limits;
+    int cnt;
+
+    s = luaL_checklstring(L,2,&len);
+    mp_check_limits(L,3,&limits); /* Raises on invalid limits. */
+    lua_settop(L,2);
+    mp_dictionary_self(L, 1);
+    if (limits.max_bytes && len > limits.max_bytes)
+        return luaL_error(L,"Input exceeds the decoding limits.");
+
+    mp_cur_init(&c,(const unsigned char *)s,len);
+    c.limits = &limits;
+    c.dict = 1;
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    for(cnt = 0; c.left > 0; cnt++) {
+        if (mp_cur_count(&c)) mp_decode_to_lua_type(L,&c);
+        if (c.err) return mp_cur_error(L,&c);
+    }
+    MP_STAT_ADD(c.stats,bytes_decoded,len);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    return cnt;
+}
+
+const struct luaL_Reg dictionary_methods[] = {
+    {"pack", mp_dictionary_pack},
+    {"unpack", mp_dictionary_unpack},
+    {0}
+};
+
+/* ---------------------------- JSON transcoding -----------------------------
+ * to_json() and from_json() convert between MessagePack and JSON text going
+ * straight from a cursor over the input to an output buffer, without
+ * creating any Lua value. The mapping is:
+ *
+ *  - nil, booleans, integers and strings map to their JSON equivalent. Binary
+ *    data (bin 8/16/32) is written as a string too. Strings are expected to
+ *    be UTF-8: '"', '\' and control characters are escaped, every other byte
+ *    is copied as it is.
+ *  - Floats and doubles are written with the shortest "%.<n>g" format (up to
+ *    9 and 17 digits) that reads back to the same value, always with '.' as
+ *    decimal point whatever the locale. NaN and infinities are written as
+ *    null.
+ *  - Map keys that are not strings are written as strings holding their JSON
+ *    text, so 1 becomes "1" and true becomes "true". Arrays and maps can't
+ *    be keys.
+ *  - Vectors and typed arrays are written as arrays of numbers, other ext
+ *    types are a format error.
+ *  - A stream of several objects is written one object per line, and
+ *    from_json() accepts a sequence of JSON values separated by whitespace.
+ *
+ * JSON numbers without fraction and exponent that fit 64 bits are encoded
+ * as integers, the others as float or double with the same rules of pack().
+ * Nesting is limited to LUACMSGPACK_MAX_JSON_NESTING levels. */
+
+/* Append the string literal '_s'. */
+#define mp_json_append(_L,_buf,_s) \
+    mp_buf_append(_L,_buf,(const unsigned char*)("" _s),sizeof(_s)-1)
+
+void mp_json_encode_string(lua_State *L, mp_buf *buf, const unsigned char *s, size_t len) {
+    static const char hexdigits[] = "0123456789abcdef";
+    unsigned char esc[6];
+    size_t i, run = 0; /* Bytes not needing escapes are appended in runs. */
+    int esclen;
+
+    mp_json_append(L,buf,"\"");
+    for (i = 0; i < len; i++) {
+        esclen = 0;
+        esc[0] = '\\';
+        switch(s[i]) {
+        case '"': esc[1] = '"'; esclen = 2; break;
+        case '\\': esc[1] = '\\'; esclen = 2; break;
+        case '\b': esc[1] = 'b'; esclen = 2; break;
+        case '\f': esc[1] = 'f'; esclen = 2; break;
+        case '\n': esc[1] = 'n'; esclen = 2; break;
+        case '\r': esc[1] = 'r'; esclen = 2; break;
+        case '\t': esc[1] = 't'; esclen = 2; break;
+        default:
+            if (s[i] < 0x20) {
+                esc[1] = 'u';
+                esc[2] = esc[3] = '0';
+                esc[4] = hexdigits[s[i] >> 4];
+                esc[5] = hexdigits[s[i] & 0xf];
+                esclen = 6;
+            }
+        }
+        if (esclen) {
+            mp_buf_append(L,buf,s+i-run,run);
+            mp_buf_append(L,buf,esc,esclen);
+            run = 0;
+        } else {
+            run++;
+        }
+    }
+    mp_buf_append(L,buf,s+len-run,run);
+    mp_json_append(L,buf,"\"");
+}
+
+/* snprintf() and strtod() use the decimal point of the current locale, like
+ * Lua does, while JSON always uses '.'. */
+#define mp_decpoint() (localeconv()->decimal_point[0])
+
+/* Replace the decimal point 'from' with 'to' in the 'len' bytes at 's'. */
+void mp_json_fix_decpoint(char *s, size_t len, char from, char to) {
+    if (from == to) return;
+    for (; len; s++, len--) if (*s == from) *s = to;
+}
+
+void mp_json_encode_double(lua_State *L, mp_buf *buf, double d, int single) {
+    char tmp[32];
+    int len, prec;
+
+    if (d != d || d == HUGE_VAL || d == -HUGE_VAL) {
+        mp_json_append(L,buf,"null");
+        return;
+    }
+    /* Use the shortest precision that reads back to the same value. */
+    for (prec = single ? 6 : 15; ; prec++) {
+        len = snprintf(tmp,sizeof(tmp),"%.*g",prec,d);
+        if (prec == (single ? 9 : 17)) break;
+        if (single ? (float)strtod(tmp,NULL) == (float)d : strtod(tmp,NULL) == d)
+            break;
+    }
+    mp_json_fix_decpoint(tmp,len,mp_decpoint(),'.');
+    mp_buf_append(L,buf,(unsigned char*)tmp,len);
+}
+
+void mp_json_encode_int(lua_State *L, mp_buf *buf, int64_t i) {
+    char tmp[24];
+    int len = snprintf(tmp,sizeof(tmp),"%lld",(long long)i);
+
+    mp_buf_append(L,buf,(unsigned char*)tmp,len);
+}
+
+void mp_json_encode_uint(lua_State *L, mp_buf *buf, uint64_t u) {
+    char tmp[24];
+    int len = snprintf(tmp,sizeof(tmp),"%llu",(unsigned long long)u);
+
+    mp_buf_append(L,buf,(unsigned char*)tmp,len);
+}
+
+/* Write the vector or typed array ext payload 'p' as a JSON array. */
+void mp_json_encode_ext(lua_State *L, mp_cur *c, mp_buf *buf, int type, const unsigned char *p, size_t len) {
+    size_t i;
+
+    if (type < LUACMSGPACK_EXT_VEC2 || type > LUACMSGPACK_EXT_INT32_ARRAY ||
+        len % 4 || (type <= LUACMSGPACK_EXT_VEC4 &&
+                    len != (size_t)(type - LUACMSGPACK_EXT_VEC2 + 2)*4))
+    {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    mp_json_append(L,buf,"[");
+    for (i = 0; i < len; i += 4) {
+        if (i) mp_json_append(L,buf,",");
+        if (type == LUACMSGPACK_EXT_INT32_ARRAY)
+            mp_json_encode_int(L,buf,(int32_t)(((uint32_t)p[i] << 24) |
+                ((uint32_t)p[i+1] << 16) | ((uint32_t)p[i+2] << 8) | p[i+3]));
+        else
+            mp_json_encode_double(L,buf,mp_read_float(p+i),1);
+    }
+    mp_json_append(L,buf,"]");
+}
+
+void mp_json_encode(lua_State *L, mp_cur *c, mp_buf *buf);
+
+/* Write the map key pointed by the cursor: strings as they are, the other
+ * scalars as a string holding their JSON text. */
+void mp_json_encode_key(lua_State *L, mp_cur *c, mp_buf *buf) {
+    unsigned char b;
+
+    mp_cur_need(c,1);
+    b = c->p[0];
+    if ((b & 0xe0) == 0xa0 || (b >= 0xd9 && b <= 0xdb) ||
+        (b >= 0xc4 && b <= 0xc6))
+    {
+        mp_json_encode(L,c,buf);
+    } else if ((b & 0xe0) == 0x80 || (b >= 0xdc && b <= 0xdf)) {
+        c->err = MP_CUR_ERROR_BADFMT;
+    } else {
+        mp_json_append(L,buf,"\"");
+        mp_json_encode(L,c,buf);
+        mp_json_append(L,buf,"\"");
+    }
+}
+
+/* Write the JSON text of the object pointed by the cursor. */
+void mp_json_encode(lua_State *L, mp_cur *c, mp_buf *buf) {
+    const unsigned char *p;
+    unsigned char b;
+    size_t len, hdr, i;
+    int type;
+
+    mp_cur_need(c,1);
+    p = c->p;
+    if (p[0] <= 0x7f || p[0] >= 0xe0) {         /* fixnum */
+        mp_json_encode_int(L,buf,p[0] <= 0x7f ? p[0] : (signed char)p[0]);
+        mp_cur_consume(c,1);
+        return;
+    }
+    if ((type = mp_cur_container(c,&len)) != MP_CONTAINER_NONE) {
+        if (c->depth >= LUACMSGPACK_MAX_JSON_NESTING) {
+            c->err = MP_CUR_ERROR_LIMIT;
+            return;
+        }
+        if (!mp_cur_enter(c,len,type == MP_CONTAINER_MAP ? 2 : 1)) return;
+        b = type == MP_CONTAINER_MAP ? '{' : '[';
+        mp_buf_append(L,buf,&b,1);
+        for (i = 0; i < len; i++) {
+            if (i) mp_json_append(L,buf,",");
+            if (type == MP_CONTAINER_MAP) {
+                mp_json_encode_key(L,c,buf);
+                if (c->err) return;
+                mp_json_append(L,buf,":");
+            }
+            mp_json_encode(L,c,buf);
+            if (c->err) return;
+        }
+        b = type == MP_CONTAINER_MAP ? '}' : ']';
+        mp_buf_append(L,buf,&b,1);
+        mp_cur_leave(c);
+        return;
+    }
+    if ((hdr = mp_cur_ext_header(c,&type,&len)) != 0) {
+        mp_cur_need_string(c,len);
+        mp_cur_need(c,hdr+len);
+        mp_json_encode_ext(L,c,buf,type,p+hdr,len);
+        mp_cur_consume(c,hdr+len);
+        return;
+    }
+    switch(p[0]) {
+    case 0xc0: mp_json_append(L,buf,"null"); mp_cur_consume(c,1); return;
+    case 0xc2: mp_json_append(L,buf,"false"); mp_cur_consume(c,1); return;
+    case 0xc3: mp_json_append(L,buf,"true"); mp_cur_consume(c,1); return;
+    case 0xcc:  /* uint 8 */
+        mp_cur_need(c,2);
+        mp_json_encode_uint(L,buf,p[1]);
+        mp_cur_consume(c,2);
+        return;
+    case 0xcd:  /* uint 16 */
+        mp_cur_need(c,3);
+        mp_json_encode_uint(L,buf,(p[1] << 8) | p[2]);
+        mp_cur_consume(c,3);
+        return;
+    case 0xce:  /* uint 32 */
+        mp_cur_need(c,5);
+        mp_json_encode_uint(L,buf,((uint32_t)p[1] << 24) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | (uint32_t)p[4]);
+        mp_cur_consume(c,5);
+        return;
+    case 0xcf:  /* uint 64 */
+    case 0xd3:  /* int 64 */
+        mp_cur_need(c,9);
+        {
+            uint64_t u = 0;
+
+            for (i = 1; i <= 8; i++) u = (u << 8) | p[i];
+            if (p[0] == 0xcf)
+                mp_json_encode_uint(L,buf,u);
+            else
+                mp_json_encode_int(L,buf,(int64_t)u);
+        }
+        mp_cur_consume(c,9);
+        return;
+    case 0xd0:  /* int 8 */
+        mp_cur_need(c,2);
+        mp_json_encode_int(L,buf,(signed char)p[1]);
+        mp_cur_consume(c,2);
+        return;
+    case 0xd1:  /* int 16 */
+        mp_cur_need(c,3);
+        mp_json_encode_int(L,buf,(int16_t)((p[1] << 8) | p[2]));
+        mp_cur_consume(c,3);
+        return;
+    case 0xd2:  /* int 32 */
+        mp_cur_need(c,5);
+        mp_json_encode_int(L,buf,(int32_t)(((uint32_t)p[1] << 24) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | (uint32_t)p[4]));
+        mp_cur_consume(c,5);
+        return;
+    case 0xca:  /* float */
+        mp_cur_need(c,5);
+        mp_json_encode_double(L,buf,mp_read_float(p+1),1);
+        mp_cur_consume(c,5);
+        return;
+    case 0xcb:  /* double */
+        mp_cur_need(c,9);
+        mp_json_encode_double(L,buf,mp_read_double(p+1),0);
+        mp_cur_consume(c,9);
+        return;
+    case 0xd9:  /* raw 8 */
+    case 0xc4:  /* bin 8 */
+        mp_cur_need(c,2);
+        len = p[1];
+        hdr = 2;
+        break;
+    case 0xda:  /* raw 16 */
+    case 0xc5:  /* bin 16 */
+        mp_cur_need(c,3);
+        len = (p[1] << 8) | p[2];
+        hdr = 3;
+        break;
+    case 0xdb:  /* raw 32 */
+    case 0xc6:  /* bin 32 */
+        mp_cur_need(c,5);
+        len = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) |
+              ((size_t)p[3] << 8) | (size_t)p[4];
+        hdr = 5;
+        break;
+    default:
+        if ((p[0] & 0xe0) != 0xa0) {  /* fix raw */
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        len = p[0] & 0x1f;
+        hdr = 1;
+    }
+    mp_cur_need_string(c,len);
+    mp_cur_need(c,hdr+len);
+    mp_json_encode_string(L,buf,p+hdr,len);
+    mp_cur_consume(c,hdr+len);
+}
+
+/* cmsgpack.to_json(msgpack [, limits]) */
+int mp_to_json(lua_State *L) {
+    size_t len;
+    const char *s;
+    mp_cur c;
+    mp_limits limits;
+    mp_buf *buf;
+    int cnt, err;
+
+    if (!lua_isstring(L,1)) return mp_fail_type(L,1,"string");
+    if ((err = mp_check_limits(L,2,&limits))) return err;
+    s = lua_tolstring(L,1,&len);
+    if (limits.max_bytes && len > limits.max_bytes)
+        return mp_fail(L,"Input exceeds the decoding limits.");
+
+    mp_cur_init(&c,(const unsigned char *)s,len);
+    c.limits = &limits;
+    buf = mp_buf_new(L);
+    for (cnt = 0; c.left > 0 && !c.err; cnt++) {
+        if (cnt) mp_json_append(L,buf,"\n");
+        if (mp_cur_count(&c)) mp_json_encode(L,&c,buf);
+    }
+    if (c.err) {
+        mp_buf_free(L, buf);
+        return mp_cur_error(L,&c);
+    }
+    lua_pushlstring(L,buf->len ? (char*)buf->b : "",buf->len);
+    mp_buf_free(L, buf);
+    return 1;
+}
+
+#define mp_json_skip_ws(_c) do { \
+    while (_c->left && (_c->p[0] == ' ' || _c->p[0] == '\t' || \
+                        _c->p[0] == '\n' || _c->p[0] == '\r')) \
+        mp_cur_consume(_c,1); \
+} while(0)
+
+/* Parse the 4 hex digits at 'p', returning -1 if they are not valid. */
+long mp_json_hex4(const unsigned char *p) {
+    long v = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        v <<= 4;
+        if (p[i] >= '0' && p[i] <= '9') v |= p[i] - '0';
+        else if (p[i] >= 'a' && p[i] <= 'f') v |= p[i] - 'a' + 10;
+        else if (p[i] >= 'A' && p[i] <= 'F') v |= p[i] - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+/* The length of JSON strings, arrays and objects is only known once they are
+ * parsed, but in MessagePack it is in the header that precedes them. Room
+ * for the largest header is reserved in front of each of them, and what
+ * goes there is recorded in a second buffer, in the order of the offsets.
+ * Once the whole input is parsed mp_json_fix_headers() writes the headers
+ * and drops the unused room in a single pass, so that the output is the
+ * same of pack() and nested values are not moved once per level. */
+
+#define MP_JSON_HEADER_ROOM 5
+
+typedef struct mp_json_fix {
+    size_t at;          /* Offset of the room reserved for the header. */
+    size_t n;           /* Length of the string, or number of elements. */
+    int type;           /* '"', '[' or '{'. */
+} mp_json_fix;
+
+/* Reserve room for a header of the given type, returning its record index. */
+size_t mp_json_fix_reserve(lua_State *L, mp_buf *buf, mp_buf *fix, int type) {
+    static const unsigned char room[MP_JSON_HEADER_ROOM] = {0};
+    mp_json_fix f;
+
+    f.at = buf->len;
+    f.n = 0;
+    f.type = type;
+    mp_buf_append(L,buf,room,sizeof(room));
+    mp_buf_append(L,fix,(const unsigned char*)&f,sizeof(f));
+    return fix->len/sizeof(f) - 1;
+}
+
+#define mp_json_fix_set(_fix,_i,_n) (((mp_json_fix*)(_fix)->b)[_i].n = (_n))
+
+void mp_json_fix_headers(lua_State *L, mp_buf *buf, mp_buf *fix) {
+    mp_json_fix *f = (mp_json_fix*)fix->b;
+    size_t count = fix->len/sizeof(*f), end = buf->len, from, len, i;
+
+    if (count == 0) return;
+    from = f[0].at;
+    mp_buf_truncate(buf,from);
+    for (i = 0; i <= count; i++) {
+        len = (i < count ? f[i].at : end) - from;
+        memmove(buf->b+buf->len,buf->b+from,len);
+        buf->len += len;
+        buf->free -= len;
+        if (i == count) break;
+        /* The header fits the reserved room, the buffer never grows. */
+        switch(f[i].type) {
+        case '"': mp_encode_bytes_header(L,buf,f[i].n); break;
+        case '[': mp_encode_array(L,buf,f[i].n); break;
+        default: mp_encode_map(L,buf,f[i].n); break;
+        }
+        from = f[i].at + MP_JSON_HEADER_ROOM;
+    }
+}
+
+/* Encode the JSON string pointed by the cursor. The unescaped bytes are
+ * written to the buffer directly, after the room for the header. */
+void mp_json_decode_string(lua_State *L, mp_cur *c, mp_buf *buf, mp_buf *fix) {
+    size_t idx = mp_json_fix_reserve(L,buf,fix,'"'), start = buf->len, run;
+    unsigned char utf8[4];
+    long cp, lo;
+
+    mp_cur_consume(c,1); /* Opening quote. */
+    while(1) {
+        for (run = 0; run < c->left && c->p[run] != '"' &&
+                      c->p[run] != '\\' && c->p[run] >= 0x20; run++);
+        mp_buf_append(L,buf,c->p,run);
+        mp_cur_consume(c,run);
+        mp_cur_need(c,1);
+        if (c->p[0] == '"') break;
+        if (c->p[0] != '\\') {          /* Unescaped control character. */
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        mp_cur_need(c,2);
+        switch(c->p[1]) {
+        case '"': case '\\': case '/': utf8[0] = c->p[1]; break;
+        case 'b': utf8[0] = '\b'; break;
+        case 'f': utf8[0] = '\f'; break;
+        case 'n': utf8[0] = '\n'; break;
+        case 'r': utf8[0] = '\r'; break;
+        case 't': utf8[0] = '\t'; break;
+        case 'u':
+            mp_cur_need(c,6);
+            cp = mp_json_hex4(c->p+2);
+            if (cp >= 0xd800 && cp <= 0xdbff) {     /* Surrogate pair. */
+                mp_cur_need(c,12);
+                lo = c->p[6] == '\\' && c->p[7] == 'u' ? mp_json_hex4(c->p+8) : -1;
+                if (lo < 0xdc00 || lo > 0xdfff) {
+                    c->err = MP_CUR_ERROR_BADFMT;
+                    return;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                mp_cur_consume(c,6);
+            } else if (cp < 0 || (cp >= 0xdc00 && cp <= 0xdfff)) {
+                c->err = MP_CUR_ERROR_BADFMT;
+                return;
+            }
+            mp_cur_consume(c,6);
+            if (cp < 0x80) {
+                utf8[0] = cp;
+                run = 1;
+            } else if (cp < 0x800) {
+                utf8[0] = 0xc0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3f);
+                run = 2;
+            } else if (cp < 0x10000) {
+                utf8[0] = 0xe0 | (cp >> 12);
+                utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[2] = 0x80 | (cp & 0x3f);
+                run = 3;
+            } else {
+                utf8[0] = 0xf0 | (cp >> 18);
+                utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+                utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[3] = 0x80 | (cp & 0x3f);
+                run = 4;
+            }
+            mp_buf_append(L,buf,utf8,run);
+            continue;
+        default:
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        mp_buf_append(L,buf,utf8,1);
+        mp_cur_consume(c,2);
+    }
+    mp_cur_consume(c,1); /* Closing quote. */
+    mp_json_fix_set(fix,idx,buf->len-start);
+}
+
+#define mp_json_isdigit(_c) ((_c) >= '0' && (_c) <= '9')
+
+void mp_json_decode_number(lua_State *L, mp_cur *c, mp_buf *buf) {
+    const unsigned char *p = c->p, *e = c->p + c->left;
+    uint64_t u = 0;
+    size_t len;
+    int neg = 0, isint = 1, overflow = 0;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p == e || !mp_json_isdigit(*p)) {
+        c->err = MP_CUR_ERROR_BADFMT;
+        return;
+    }
+    if (*p == '0') {
+        p++;
+    } else {
+        for (; p < e && mp_json_isdigit(*p); p++) {
+            if (u > (UINT64_MAX - 9) / 10) overflow = 1;
+            u = u*10 + (*p - '0');
+        }
+    }
+    if (p < e && *p == '.') {
+        isint = 0;
+        if (++p == e || !mp_json_isdigit(*p)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        while (p < e && mp_json_isdigit(*p)) p++;
+    }
+    if (p < e && (*p == 'e' || *p == 'E')) {
+        isint = 0;
+        if (++p < e && (*p == '+' || *p == '-')) p++;
+        if (p == e || !mp_json_isdigit(*p)) {
+            c->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        while (p < e && mp_json_isdigit(*p)) p++;
+    }
+    len = p - c->p;
+    if (isint && !overflow && u <= (uint64_t)INT64_MAX + neg) {
+        mp_encode_int(L,buf,neg ? (int64_t)(0 - u) : (int64_t)u);
+    } else if (mp_decpoint() == '.') {
+        /* The number is validated, strtod() can't go past its end. */
+        mp_encode_double(L,buf,strtod((const char*)c->p,NULL));
+    } else {
+        /* strtod() wants the decimal point of the locale: parse a copy. */
+        char tmp[64], *s = tmp;
+        double d;
+
+        if (len >= sizeof(tmp)) s = (char*)mp_realloc(L,NULL,0,len+1);
+        memcpy(s,c->p,len);
+        s[len] = '\0';
+        mp_json_fix_decpoint(s,len,'.',mp_decpoint());
+        d = strtod(s,NULL);
+        if (s != tmp) mp_realloc(L,s,len+1,0);
+        mp_encode_double(L,buf,d);
+    }
+    mp_cur_consume(c,len);
+}
+
+void mp_json_decode(lua_State *L, mp_cur *c, mp_buf *buf, mp_buf *fix);
+
+/* Encode the JSON array or object pointed by the cursor. Like strings, the
+ * elements are written after the room for the header. */
+void mp_json_decode_container(lua_State *L, mp_cur *c, mp_buf *buf, mp_buf *fix) {
+    size_t idx, count = 0;
+    int map = c->p[0] == '{';
+    unsigned char close = map ? '}' : ']';
+
+    if (c->depth >= LUACMSGPACK_MAX_JSON_NESTING) {
+        c->err = MP_CUR_ERROR_LIMIT;
+        return;
+    }
+    c->depth++;
+    idx = mp_json_fix_reserve(L,buf,fix,c->p[0]);
+    mp_cur_consume(c,1);
+    mp_json_skip_ws(c);
+    mp_cur_need(c,1);
+    while (c->p[0] != close) {
+        if (count) {
+            if (c->p[0] != ',') {
+                c->err = MP_CUR_ERROR_BADFMT;
+                return;
+            }
+            mp_cur_consume(c,1);
+        }
+        if (map) {
+            mp_json_skip_ws(c);
+            mp_cur_need(c,1);
+            if (c->p[0] != '"') {
+                c->err = MP_CUR_ERROR_BADFMT;
+                return;
+            }
+            mp_json_decode_string(L,c,buf,fix);
+            if (c->err) return;
+            mp_json_skip_ws(c);
+            mp_cur_need(c,1);
+            if (c->p[0] != ':') {
+                c->err = MP_CUR_ERROR_BADFMT;
+                return;
+            }
+            mp_cur_consume(c,1);
+        }
+        mp_json_decode(L,c,buf,fix);
+        if (c->err) return;
+        count++;
+        mp_json_skip_ws(c);
+        mp_cur_need(c,1);
+    }
+    mp_cur_consume(c,1);
+    c->depth--;
+    mp_json_fix_set(fix,idx,count);
+}
+
+/* Encode the JSON value pointed by the cursor. */
+void mp_json_decode(lua_State *L, mp_cur *c, mp_buf *buf, mp_buf *fix) {
+    unsigned char b;
+
+    mp_json_skip_ws(c);
+    mp_cur_need(c,1);
+    switch(c->p[0]) {
+    case '{': case '[': mp_json_decode_container(L,c,buf,fix); return;
+    case '"': mp_json_decode_string(L,c,buf,fix); return;
+    case 't':
+        mp_cur_need(c,4);
+        if (memcmp(c->p,"true",4)) break;
+        b = 0xc3;
+        mp_buf_append(L,buf,&b,1);
+        mp_cur_consume(c,4);
+        return;
+    case 'f':
+        mp_cur_need(c,5);
+        if (memcmp(c->p,"false",5)) break;
+        b = 0xc2;
+        mp_buf_append(L,buf,&b,1);
+        mp_cur_consume(c,5);
+        return;
+    case 'n':
+        mp_cur_need(c,4);
+        if (memcmp(c->p,"null",4)) break;
+        b = 0xc0;
+        mp_buf_append(L,buf,&b,1);
+        mp_cur_consume(c,4);
+        return;
+    default:
+        if (c->p[0] == '-' || mp_json_isdigit(c->p[0])) {
+            mp_json_decode_number(L,c,buf);
+            return;
+        }
+    }
+    c->err = MP_CUR_ERROR_BADFMT;
+}
+
+/* cmsgpack.from_json(json) */
+int mp_from_json(lua_State *L) {
+    size_t len;
+    const char *s;
+    mp_cur c;
+    mp_buf *buf, *fix;
+
+    if (!lua_isstring(L,1)) return mp_fail_type(L,1,"string");
+    s = lua_tolstring(L,1,&len);
+    mp_cur_init(&c,(const unsigned char *)s,len);
+    buf = mp_buf_new(L);
+    fix = mp_buf_new(L);
+    while(1) {
+        mp_json_skip_ws((&c));
+        if (c.left == 0) break;
+        mp_json_decode(L,&c,buf,fix);
+        /* Values of a sequence must be separated by whitespace. */
+        if (!c.err && c.left && c.p[0] != ' ' && c.p[0] != '\t' &&
+            c.p[0] != '\n' && c.p[0] != '\r')
+            c.err = MP_CUR_ERROR_BADFMT;
+        if (c.err) {
+            mp_buf_free(L, buf);
+            mp_buf_free(L, fix);
+            if (c.err == MP_CUR_ERROR_LIMIT)
+                return mp_fail(L,"JSON input nested too deeply.");
+            return mp_fail(L,"Invalid JSON input at offset %d.",
+                              (int)(len - c.left));
+        }
+    }
+    mp_json_fix_headers(L,buf,fix);
+    mp_buf_free(L, fix);
+    lua_pushlstring(L,buf->len ? (char*)buf->b : "",buf->len);
+    MP_STAT_ADD(buf->stats,bytes_encoded,buf->len);
+    mp_buf_free(L, buf);
+    return 1;
+}
+
+/* ------------------------------ Decode cache ------------------------------
+ * new_cache(budget) returns an object whose unpack method remembers the
+ * values decoded from recent inputs, so that the same message unpacked by
+ * many handlers is decoded only once. Inputs are looked up by their XXH64
+ * digest and length, and compared byte by byte with the cached one before
+ * being reused. The least recently used inputs are evicted as soon as the
+ * total length of the cached inputs would exceed the budget.
+ *
+ * The decoded values are shared by all the callers, so tables are returned
+ * as read-only proxies: empty tables with a metatable whose __index is the
+ * real table and whose __newindex raises an error. The tables nested in the
+ * values are proxies as well (table keys are left as they are), and vectors
+ * and typed arrays are frozen, raising on assignment too. Every proxy
+ * has its own metatable, so a cached table costs two more tables, and the
+ * budget counts the length of the inputs, not the memory of the values.
+ *
+ * The C side (mp_cache) keeps a hash table and the LRU list of the entries,
+ * while the entries themselves are stored in the user value table of the
+ * object, at the index of their slot: a table holding the input at index 1,
+ * the number of values at index 2 and then the values. */
+
+#define LUACMSGPACK_CACHE_MT    "cmsgpack.cache"
+#define LUACMSGPACK_READONLY_MT "cmsgpack.readonly"
+
+#if LUA_VERSION_NUM < 502
+#define mp_getuservalue(L,idx) lua_getfenv(L,idx)
+#define mp_setuservalue(L,idx) lua_setfenv(L,idx)
+#else
+#define mp_getuservalue(L,idx) lua_getuservalue(L,idx)
+#define mp_setuservalue(L,idx) lua_setuservalue(L,idx)
+#endif
+
+typedef struct mp_cache_entry {
+    uint64_t hash;
+    size_t len;
+    int prev, next;         /* LRU list, or free list (next only). */
+    int chain;              /* Next entry of the same hash bucket. */
+} mp_cache_entry;
+
+typedef struct mp_cache {
+    size_t budget, bytes;
+    uint64_t hits, misses, evictions;
+    int entries;
+    int size;               /* Number of slots, zero or a power of two. */
+    int head, tail;         /* Most and least recently used entries. */
+    int free;               /* First free slot, or 0. */
+    mp_cache_entry *slots;  /* 'size' + 1 slots, slot 0 is not used. */
+    int *buckets;           /* 'size' hash buckets. */
+} mp_cache;
+
+int mp_readonly_newindex(lua_State *L) {
+    return luaL_error(L, "Attempt to modify a read-only table.");
+}
+
+/* Push the real table of the proxy at index 1, or the table itself if it
+ * is not a proxy. */
+void mp_readonly_self(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushvalue(L, 1);
+    mp_readonly_real(L);
+}
+
+int mp_readonly_len(lua_State *L) {
+    mp_readonly_self(L);
+#if LUA_VERSION_NUM < 502
+    lua_pushinteger(L, (lua_Integer)lua_objlen(L, -1));
+#else
+    lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+#endif
+    return 1;
+}
+
+int mp_readonly_next(lua_State *L) {
+    lua_settop(L, 2);
+    mp_readonly_self(L);
+    lua_pushvalue(L, 2);
+    if (lua_next(L, 3)) return 2;
+    lua_pushnil(L);
+    return 1;
+}
+
+int mp_readonly_inext(lua_State *L) {
+    int i = (int)luaL_checkinteger(L, 2) + 1;
+
+    mp_readonly_self(L);
+    lua_pushinteger(L, i);
+    lua_rawgeti(L, -2, i);
+    return lua_isnil(L, -1) ? 1 : 2;
+}
+
+/* __pairs and __ipairs iterate over the real table. The same functions,
+ * and __len, are exported as cmsgpack.pairs(), ipairs() and len(), that
+ * work with proxies and plain tables alike on every Lua version: Lua 5.1
+ * ignores these metamethods for tables. The iterator state is the proxy,
+ * whose real table is looked up at every step, so that the real table is
+ * never handed to Lua. */
+int mp_readonly_pairs(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushcfunction(L, mp_readonly_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+int mp_readonly_ipairs(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushcfunction(L, mp_readonly_inext);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/* Metamethods copied into the metatable of every proxy, in addition to
+ * __index and __metatable. */
+const struct luaL_Reg readonly_methods[] = {
+    {"__newindex", mp_readonly_newindex},
+    {"__len", mp_readonly_len},
+    {"__pairs", mp_readonly_pairs},
+    {"__ipairs", mp_readonly_ipairs},
+    {0}
+};
+
+/* Replace the table on top of the stack with a read-only proxy, after doing
+ * the same with the tables it holds as values, and freezing the vectors and
+ * typed arrays it holds. 'tpl' is the stack index of the
+ * LUACMSGPACK_READONLY_MT metatable, whose methods are copied. */
+void mp_cache_freeze(lua_State *L, int tpl) {
+    int i;
+
+    luaL_checkstack(L, 4, "in function mp_cache_freeze");
+    lua_pushnil(L);
+    while(lua_next(L,-2)) {
+        /* Stack: ... table key value */
+        mp_freeze_userdata(L,-2);
+        mp_freeze_userdata(L,-1);
+        if (lua_istable(L,-1)) {
+            mp_cache_freeze(L,tpl);
+            lua_pushvalue(L,-2);
+            lua_insert(L,-2);
+            lua_rawset(L,-4); /* Replacing an existing field is allowed. */
+        } else {
+            lua_pop(L,1);
+        }
+    }
+    lua_newtable(L);
+    lua_createtable(L,0,6);
+    for (i = 0; readonly_methods[i].name; i++) {
+        lua_getfield(L,tpl,readonly_methods[i].name);
+        lua_setfield(L,-2,readonly_methods[i].name);
+    }
+    lua_pushvalue(L,-3);
+    lua_setfield(L,-2,"__index");
+    lua_pushboolean(L,0);
+    lua_setfield(L,-2,"__metatable");
+    lua_setmetatable(L,-2);
+    lua_replace(L,-2);
+}
+
+/* Unlink the entry from the LRU list. */
+void mp_cache_unlink(mp_cache *cache, int slot) {
+    mp_cache_entry *e = cache->slots + slot;
+
+    if (e->prev) cache->slots[e->prev].next = e->next;
+    else cache->head = e->next;
+    if (e->next) cache->slots[e->next].prev = e->prev;
+    else cache->tail = e->prev;
+}
+
+/* Link the entry as the most recently used one. */
+void mp_cache_link(mp_cache *cache, int slot) {
+    mp_cache_entry *e = cache->slots + slot;
+
+    e->prev = 0;
+    e->next = cache->head;
+    if (cache->head) cache->slots[cache->head].prev = slot;
+    else cache->tail = slot;
+    cache->head = slot;
+}
+
+/* Return the slot of the entry with the given digest and length, or 0. */
+int mp_cache_find(mp_cache *cache, uint64_t hash, size_t len) {
+    int slot;
+
+    if (!cache->size) return 0;
+    slot = cache->buckets[hash & (cache->size-1)];
+    while(slot && (cache->slots[slot].hash != hash ||
+                   cache->slots[slot].len != len))
+        slot = cache->slots[slot].chain;
+    return slot;
+}
+
+/* Double the number of slots, rehashing the entries. */
+void mp_cache_grow(lua_State *L, mp_cache *cache) {
+    int size = cache->size ? cache->size*2 : 16, slot;
+
+    cache->slots = (mp_cache_entry*)mp_realloc(L, cache->slots,
+        cache->size ? sizeof(*cache->slots)*(cache->size+1) : 0,
+        sizeof(*cache->slots)*(size+1));
+    cache->buckets = (int*)mp_realloc(L, cache->buckets,
+        sizeof(*cache->buckets)*cache->size, sizeof(*cache->buckets)*size);
+    memset(cache->buckets, 0, sizeof(*cache->buckets)*size);
+    for (slot = size; slot > cache->size; slot--) {
+        cache->slots[slot].next = cache->free;
+        cache->free = slot;
+    }
+    cache->size = size;
+    for (slot = cache->head; slot; slot = cache->slots[slot].next) {
+        int *b = cache->buckets + (cache->slots[slot].hash & (size-1));
+
+        cache->slots[slot].chain = *b;
+        *b = slot;
+    }
+}
+
+/* Add an entry and return its slot, where the caller stores its table. */
+int mp_cache_insert(lua_State *L, mp_cache *cache, uint64_t hash, size_t len) {
+    mp_cache_entry *e;
+    int slot, *b;
+
+    if (!cache->free) mp_cache_grow(L, cache);
+    slot = cache->free;
+    e = cache->slots + slot;
+    cache->free = e->next;
+    e->hash = hash;
+    e->len = len;
+    b = cache->buckets + (hash & (cache->size-1));
+    e->chain = *b;
+    *b = slot;
+    mp_cache_link(cache, slot);
+    cache->bytes += len;
+    cache->entries++;
+    return slot;
+}
+
+/* Remove an entry, and its table from the user value table at index 'uv'. */
+void mp_cache_remove(lua_State *L, mp_cache *cache, int uv, int slot) {
+    mp_cache_entry *e = cache->slots + slot;
+    int *b = cache->buckets + (e->hash & (cache->size-1));
+
+    while (*b != slot) b = &cache->slots[*b].chain;
+    *b = e->chain;
+    mp_cache_unlink(cache, slot);
+    e->next = cache->free;
+    cache->free = slot;
+    cache->bytes -= e->len;
+    cache->entries--;
+    lua_pushnil(L);
+    lua_rawseti(L, uv, slot);
+}
+
+int mp_cache_new(lua_State *L) {
+    lua_Number budget = luaL_checknumber(L, 1);
+    mp_cache *cache;
+
+    if (!(budget >= 0)) /* NaN too. */
+        return luaL_argerror(L, 1, "budget must be a non negative number");
+    cache = (mp_cache*)lua_newuserdata(L, sizeof(*cache));
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget >= (lua_Number)SIZE_MAX ? SIZE_MAX : (size_t)budget;
+    luaL_getmetatable(L, LUACMSGPACK_CACHE_MT);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    mp_setuservalue(L, -2);
+    return 1;
+}
+
+int mp_cache_gc(lua_State *L) {
+    mp_cache *cache = (mp_cache*)luaL_checkudata(L, 1, LUACMSGPACK_CACHE_MT);
+
+    if (cache->size) {
+        mp_realloc(L, cache->slots, sizeof(*cache->slots)*(cache->size+1), 0);
+        mp_realloc(L, cache->buckets, sizeof(*cache->buckets)*cache->size, 0);
+        cache->slots = NULL;
+        cache->buckets = NULL;
+        cache->size = cache->free = cache->head = cache->tail = 0;
+        cache->entries = 0;
+        cache->bytes = 0;
+    }
+    return 0;
+}
+
+/* cache:unpack(msgpack), the same as unpack() but returning the values of a
+ * previous call with the same input while it is cached. Inputs longer than
+ * the budget are decoded as usual and never cached. */
+int mp_cache_unpack(lua_State *L) {
+    mp_cache *cache = (mp_cache*)luaL_checkudata(L, 1, LUACMSGPACK_CACHE_MT);
+    size_t len, elen;
+    const char *s, *e;
+    mp_xxh64 h;
+    uint64_t hash;
+    mp_cur c;
+    int slot, cnt, i;
+
+    s = luaL_checklstring(L, 2, &len);
+    lua_settop(L, 2);
+    mp_getuservalue(L, 1); /* Stack: cache msgpack entries */
+    mp_xxh64_init(&h);
+    mp_xxh64_update(&h, (const unsigned char*)s, len);
+    hash = mp_xxh64_digest(&h);
+
+    if ((slot = mp_cache_find(cache, hash, len))) {
+        lua_rawgeti(L, 3, slot);
+        lua_rawgeti(L, 4, 1);
+        e = lua_tolstring(L, -1, &elen);
+        lua_pop(L, 1);
+        if (e == s || memcmp(e, s, len) == 0) {
+            cache->hits++;
+            mp_cache_unlink(cache, slot);
+            mp_cache_link(cache, slot);
+            lua_rawgeti(L, 4, 2);
+            cnt = (int)lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            luaL_checkstack(L, cnt, "too many values in cached input");
+            for (i = 1; i <= cnt; i++) lua_rawgeti(L, 4, i+2);
+            return cnt;
+        }
+        /* Same digest and length, but a different input. */
+        lua_pop(L, 1);
+        mp_cache_remove(L, cache, 3, slot);
+    }
+    cache->misses++;
+
+    mp_cur_init(&c,(const unsigned char *)s,len);
+#ifdef LUACMSGPACK_STATS
+    c.stats = mp_stats_get(L);
+#endif
+    for(cnt = 0; c.left > 0; cnt++) {
+        if (mp_cur_count(&c)) mp_decode_to_lua_type(L,&c);
+        if (c.err) return mp_cur_error(L,&c);
+    }
+    MP_STAT_ADD(c.stats,bytes_decoded,len);
+    MP_STAT_ADD(c.stats,unpack_calls,1);
+    if (len > cache->budget) return cnt;
+
+    while (cache->entries && cache->bytes + len > cache->budget) {
+        mp_cache_remove(L, cache, 3, cache->tail);
+        cache->evictions++;
+    }
+    luaL_checkstack(L, 3, "in function mp_cache_unpack");
+    luaL_getmetatable(L, LUACMSGPACK_READONLY_MT);
+    for (i = 4; i < 4+cnt; i++) {
+        mp_freeze_userdata(L, i);
+        if (!lua_istable(L, i)) continue;
+        lua_pushvalue(L, i);
+        mp_cache_freeze(L, 4+cnt);
+        lua_replace(L, i);
+    }
+    lua_pop(L, 1);
+    lua_createtable(L, cnt+2, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, (lua_Number)cnt);
+    lua_rawseti(L, -2, 2);
+    for (i = 1; i <= cnt; i++) {
+        lua_pushvalue(L, 3+i);
+        lua_rawseti(L, -2, i+2);
+    }
+    lua_rawseti(L, 3, mp_cache_insert(L, cache, hash, len));
+    return cnt;
+}
+
+/* cache:stats() returns a table with the counters of the cache. */
+/* Push a count as an integer, or as a number if lua_Integer can't hold it
+ * (a budget of math.huge is SIZE_MAX). */
+void mp_push_count(lua_State *L, uint64_t n) {
+    if (n <= ((uint64_t)-1 >> (65 - 8*sizeof(lua_Integer))))
+        lua_pushinteger(L, (lua_Integer)n);
+    else
+        lua_pushnumber(L, (lua_Number)n);
+}
+
+int mp_cache_stats(lua_State *L) {
+    mp_cache *cache = (mp_cache*)luaL_checkudata(L, 1, LUACMSGPACK_CACHE_MT);
+
+    lua_createtable(L, 0, 6);
+#define MP_CACHE_FIELD(_field) do { \
+    mp_push_count(L, (uint64_t)cache->_field); \
+    lua_setfield(L, -2, #_field); \
+} while(0)
+    MP_CACHE_FIELD(hits);
+    MP_CACHE_FIELD(misses);
+    MP_CACHE_FIELD(evictions);
+    MP_CACHE_FIELD(entries);
+    MP_CACHE_FIELD(bytes);
+    MP_CACHE_FIELD(budget);
+#undef MP_CACHE_FIELD
+    return 1;
+}
+
+const struct luaL_Reg cache_methods[] = {
+    {"unpack", mp_cache_unpack},
+    {"stats", mp_cache_stats},
+    {"__gc", mp_cache_gc},
+    {0}
+};
+
+/* ---------------------------- Chunked encoding -----------------------------
+ * pack_chunks(obj, size) returns an iterator producing the encoding of 'obj'
+ * in chunks of 'size' bytes (the last one may be shorter), the same bytes
+ * pack(obj) would produce. The traversal is not recursive: the state of the
+ * open arrays and maps is kept in an explicit stack of frames, so encoding
+ * can stop as soon as a chunk is full and resume at the next call. Headers
+ * and scalars are encoded into a small scratch buffer, while the payload of
+ * strings is copied straight from the Lua string, so long strings are split
+ * across chunks without being buffered.
+ *
+ * The tables of the open frames, the current key of the open maps and the
+ * string being copied are anchored in the user value table of the object:
+ * the string at index 0, the object to encode at index 1, and then for the
+ * frame at depth d the table at index 2*d and the map key at index 2*d+1. */
+
+#define LUACMSGPACK_CHUNKER_MT "cmsgpack.chunker"
+
+typedef struct mp_chunk_frame {
+    int map;                /* 1 for a map, 0 for an array. */
+    int key;                /* For maps, true if a key comes next. */
+    size_t i, len;          /* Elements encoded so far and in total. */
+} mp_chunk_frame;
+
+typedef struct mp_chunker {
+    size_t size;            /* Chunk size. */
+    unsigned char *chunk;   /* Chunk being filled, 'size' bytes. */
+    mp_buf *scratch;        /* Encoding of the current item... */
+    size_t scratch_pos;     /* ...and how much of it was already output. */
+    const unsigned char *str;   /* Payload of the string being output... */
+    size_t str_left;            /* ...and its length still to output. */
+    int started, done;
+    int depth;              /* Open frames. */
+    mp_chunk_frame frames[LUACMSGPACK_MAX_NESTING];
+} mp_chunker;
+
+/* Start the encoding of the value on top of the stack, that is popped: the
+ * header of tables and strings, or the whole value for the other types. */
+void mp_chunker_value(lua_State *L, mp_chunker *ck, int uv) {
+    int t = lua_type(L,-1);
+
+    if (t == LUA_TTABLE) mp_readonly_real(L);
+    if (t == LUA_TTABLE && ck->depth == LUACMSGPACK_MAX_NESTING) t = LUA_TNIL;
+    if (t == LUA_TSTRING) {
+        size_t len;
+
+        ck->str = (const unsigned char*)lua_tolstring(L,-1,&len);
+        ck->str_left = len;
+        mp_encode_bytes_header(L,ck->scratch,len);
+        lua_rawseti(L,uv,0);
+    } else if (t == LUA_TTABLE) {
+        mp_chunk_frame *f = ck->frames + ck->depth++;
+
+        f->i = 0;
+        f->key = 1;
+        f->map = !table_is_an_array(L,NULL);
+        MP_STAT_MAX(ck->scratch->stats,max_encode_depth,ck->depth);
+        if (f->map) {
+            MP_STAT_ADD(ck->scratch->stats,tables_as_map,1);
+            f->len = mp_table_count(L);
+            mp_encode_map(L,ck->scratch,f->len);
+        } else {
+            MP_STAT_ADD(ck->scratch->stats,tables_as_array,1);
+#if LUA_VERSION_NUM < 502
+            f->len = lua_objlen(L,-1);
+#else
+            f->len = lua_rawlen(L,-1);
+#endif
+            mp_encode_array(L,ck->scratch,f->len);
+        }
+        lua_rawseti(L,uv,2*ck->depth);
+        lua_pushnil(L);
+        lua_rawseti(L,uv,2*ck->depth+1);
+    } else {
+        mp_encode_lua_type(L,ck->scratch,ck->depth);
+    }
+}
+
+/* Encode the next item of the traversal into the scratch buffer (and set
+ * the string to copy, if any). Returns 0 if the traversal is complete. */
+int mp_chunker_step(lua_State *L, mp_chunker *ck, int uv) {
+    ck->scratch->free += ck->scratch->len;
+    ck->scratch->len = 0;
+    ck->scratch_pos = 0;
+    luaL_checkstack(L, 4, "in function mp_chunker_step");
+
+    if (!ck->started) {
+        ck->started = 1;
+        lua_rawgeti(L,uv,1);
+        lua_pushnil(L);
+        lua_rawseti(L,uv,1);
+        mp_chunker_value(L,ck,uv);
+        return 1;
+    }
+    while(ck->depth) {
+        mp_chunk_frame *f = ck->frames + ck->depth - 1;
+        int t = 2*ck->depth;
+
+        lua_rawgeti(L,uv,t); /* Stack: ... table */
+        if (f->map && f->key) {
+            lua_rawgeti(L,uv,t+1);
+            if (lua_next(L,-2)) {
+                /* Stack: ... table key value */
+                lua_pop(L,1);
+                lua_pushvalue(L,-1);
+                lua_rawseti(L,uv,t+1);
+                lua_remove(L,-2);
+                f->key = 0;
+                mp_chunker_value(L,ck,uv);
+                return 1;
+            }
+        } else if (f->map) {
+            lua_rawgeti(L,uv,t+1);
+            lua_rawget(L,-2);
+            lua_remove(L,-2);
+            f->key = 1;
+            f->i++;
+            mp_chunker_value(L,ck,uv);
+            return 1;
+        } else if (f->i < f->len) {
+            lua_rawgeti(L,-1,(int)++f->i);
+            lua_remove(L,-2);
+            mp_chunker_value(L,ck,uv);
+            return 1;
+        }
+        /* The frame is complete. */
+        lua_pop(L,1);
+        lua_pushnil(L);
+        lua_rawseti(L,uv,t);
+        lua_pushnil(L);
+        lua_rawseti(L,uv,t+1);
+        ck->depth--;
+    }
+    return 0;
+}
+
+/* Iterator function of pack_chunks(): returns the next chunk, or nil. */
+int mp_chunks_next(lua_State *L) {
+    mp_chunker *ck = (mp_chunker*)luaL_checkudata(L, 1, LUACMSGPACK_CHUNKER_MT);
+    size_t n = 0, len;
+
+    lua_settop(L, 1);
+    mp_getuservalue(L, 1);
+    while(n < ck->size) {
+        if (ck->scratch_pos < ck->scratch->len) {
+            len = ck->scratch->len - ck->scratch_pos;
+            if (len > ck->size - n) len = ck->size - n;
+            memcpy(ck->chunk + n, ck->scratch->b + ck->scratch_pos, len);
+            ck->scratch_pos += len;
+            n += len;
+        } else if (ck->str_left) {
+            len = ck->str_left;
+            if (len > ck->size - n) len = ck->size - n;
+            memcpy(ck->chunk + n, ck->str, len);
+            ck->str += len;
+            ck->str_left -= len;
+            n += len;
+        } else if (ck->done || !mp_chunker_step(L, ck, 2)) {
+            ck->done = 1;
+            break;
+        }
+    }
+    if (n == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushlstring(L, (char*)ck->chunk, n);
+    MP_STAT_ADD(ck->scratch->stats,bytes_encoded,n);
+    if (ck->done) {
+        MP_STAT_ADD(ck->scratch->stats,pack_calls,1);
+    }
+    return 1;
+}
+
+int mp_pack_chunks(lua_State *L) {
+    lua_Number size = luaL_checknumber(L, 2);
+    mp_chunker *ck;
+
+    luaL_checkany(L, 1);
+    if (!(size >= 1 && size < (lua_Number)INT_MAX)) /* NaN too. */
+        return luaL_argerror(L, 2, "chunk size out of range");
+    lua_settop(L, 1);
+    lua_pushcfunction(L, mp_chunks_next);
+    ck = (mp_chunker*)lua_newuserdata(L, sizeof(*ck) + (size_t)size);
+    memset(ck, 0, sizeof(*ck));
+    ck->size = (size_t)size;
+    ck->chunk = (unsigned char*)(ck+1);
+    luaL_getmetatable(L, LUACMSGPACK_CHUNKER_MT);
+    lua_setmetatable(L, -2);
+    ck->scratch = mp_buf_new(L);
+    lua_createtable(L, 2*LUACMSGPACK_MAX_NESTING+2, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    mp_setuservalue(L, -2);
+    return 2;
+}
+
+int mp_chunker_gc(lua_State *L) {
+    mp_chunker *ck = (mp_chunker*)luaL_checkudata(L, 1, LUACMSGPACK_CHUNKER_MT);
+
+    if (ck->scratch) mp_buf_free(L, ck->scratch);
+    ck->scratch = NULL;
+    return 0;
+}
+
+const struct luaL_Reg chunker_methods[] = {
+    {"__gc", mp_chunker_gc},
+    {0}
+};
+
+/* Wrapper of the functions of the safe API that do not report errors with
+ * mp_fail(): the function is called in protected mode. Only the module
+ * functions are wrapped: the methods of the objects they create live in
+ * metatables shared with the regular module, and always raise. */
+int mp_safe(lua_State *L) {
+    int argc, err, total_results;
+
+    argc = lua_gettop(L);
+
+    /* This adds our function to the bottom of the stack
+     * (the "call this function" position) */
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+
+    err = lua_pcall(L, argc, LUA_MULTRET, 0);
+    total_results = lua_gettop(L);
+
+    if (!err) {
+        return total_results;
+    } else {
+        lua_pushnil(L);
+        lua_insert(L,-2);
+        return 2;
+    }
+}
+
+#ifdef LUACMSGPACK_STATS
+/* Return a table with the instrumentation counters of this Lua state. */
+int mp_stats_lua(lua_State *L) {
+    mp_stats *stats = mp_stats_get(L);
+    int i;
+
+    lua_newtable(L);
+#define MP_STAT_FIELD(_field) do { \
+    lua_pushnumber(L, (lua_Number)stats->_field); \
+    lua_setfield(L, -2, #_field); \
+} while(0)
+    MP_STAT_FIELD(bytes_encoded);
+    MP_STAT_FIELD(bytes_decoded);
+    MP_STAT_FIELD(realloc_calls);
+    MP_STAT_FIELD(realloc_bytes);
+    MP_STAT_FIELD(tables_as_array);
+    MP_STAT_FIELD(tables_as_map);
+    MP_STAT_FIELD(max_encode_depth);
+    MP_STAT_FIELD(max_decode_depth);
+    MP_STAT_FIELD(pack_calls);
+    MP_STAT_FIELD(unpack_calls);
+    MP_STAT_FIELD(pack_ns);
+    MP_STAT_FIELD(unpack_ns);
+#undef MP_STAT_FIELD
+
+    lua_newtable(L);
+    for (i = 0; i < MP_STAT_TYPES; i++) {
+        lua_pushnumber(L, (lua_Number)stats->encoded[i]);
+        lua_setfield(L, -2, mp_stats_type_names[i]);
+    }
+    lua_setfield(L, -2, "encoded");
+
+    lua_newtable(L);
+    for (i = 0; i < MP_STAT_TYPES; i++) {
+        lua_pushnumber(L, (lua_Number)stats->decoded[i]);
+        lua_setfield(L, -2, mp_stats_type_names[i]);
+    }
+    lua_setfield(L, -2, "decoded");
+    return 1;
+}
+
+int mp_reset_stats(lua_State *L) {
+    memset(mp_stats_get(L), 0, sizeof(mp_stats));
+    return 0;
+}
+#endif
+
+/* ------------------------- Native vector types API ------------------------ */
+
+/* Convert to float a number that may be out of the float range, that would
+ * be undefined behavior: it becomes an infinity, like IEEE overflow. */
+float mp_to_float(lua_Number n) {
+    if (n > FLT_MAX) return HUGE_VALF;
+    if (n < -FLT_MAX) return -HUGE_VALF;
+    return (float)n;
+}
+
+/* Map a vector key (x, y, z, w or 1 to n) to a component index, or -1. */
+int mp_vector_component(lua_State *L, mp_vector *vec, int idx) {
+    int i = -1;
+
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        i = (int)lua_tointeger(L, idx) - 1;
+    } else if (lua_type(L, idx) == LUA_TSTRING) {
+        size_t len;
+        const char *k = lua_tolstring(L, idx, &len);
+
+        if (len == 1) {
+            switch(k[0]) {
+            case 'x': i = 0; break;
+            case 'y': i = 1; break;
+            case 'z': i = 2; break;
+            case 'w': i = 3; break;
+            }
+        }
+    }
+    return (i >= 0 && i < vec->n) ? i : -1;
+}
+
+int mp_vector_new(lua_State *L, int n) {
+    mp_vector *vec;
+    lua_Number v[4];
+    int i;
+
+    for (i = 0; i < n; i++) v[i] = luaL_checknumber(L, i+1);
+    vec = mp_push_vector(L, n);
+    for (i = 0; i < n; i++) vec->v[i] = mp_to_float(v[i]);
+    return 1;
+}
+
+int mp_vec2(lua_State *L) { return mp_vector_new(L, 2); }
+int mp_vec3(lua_State *L) { return mp_vector_new(L, 3); }
+int mp_vec4(lua_State *L) { return mp_vector_new(L, 4); }
+
+int mp_vector_index(lua_State *L) {
+    mp_vector *vec = (mp_vector*)luaL_checkudata(L, 1, LUACMSGPACK_VECTOR_MT);
+    int i = mp_vector_component(L, vec, 2);
+
+    if (i < 0)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, vec->v[i]);
+    return 1;
+}
+
+int mp_vector_newindex(lua_State *L) {
+    mp_vector *vec = (mp_vector*)luaL_checkudata(L, 1, LUACMSGPACK_VECTOR_MT);
+    int i = mp_vector_component(L, vec, 2);
+
+    if (i < 0)
+        return luaL_error(L, "Invalid component for a vector of size %d.", vec->n);
+    if (vec->frozen)
+        return luaL_error(L, "Attempt to modify a read-only vector.");
+    vec->v[i] = mp_to_float(luaL_checknumber(L, 3));
+    return 0;
+}
+
+int mp_vector_len(lua_State *L) {
+    mp_vector *vec = (mp_vector*)luaL_checkudata(L, 1, LUACMSGPACK_VECTOR_MT);
+
+    lua_pushinteger(L, vec->n);
+    return 1;
+}
+
+int mp_vector_eq(lua_State *L) {
+    mp_vector *a = (mp_vector*)luaL_checkudata(L, 1, LUACMSGPACK_VECTOR_MT);
+    mp_vector *b = (mp_vector*)luaL_checkudata(L, 2, LUACMSGPACK_VECTOR_MT);
+    int i, eq = a->n == b->n;
+
+    for (i = 0; eq && i < a->n; i++) eq = a->v[i] == b->v[i];
+    lua_pushboolean(L, eq);
+    return 1;
+}
+
+int mp_vector_tostring(lua_State *L) {
+    mp_vector *vec = (mp_vector*)luaL_checkudata(L, 1, LUACMSGPACK_VECTOR_MT);
+    int i;
+
+    lua_pushfstring(L, "vec%d(", vec->n);
+    for (i = 0; i < vec->n; i++)
+        lua_pushfstring(L, i ? ", %f" : "%f", (lua_Number)vec->v[i]);
+    lua_pushliteral(L, ")");
+    lua_concat(L, vec->n + 2);
+    return 1;
+}
+
+/* float32_array(n) / int32_array(n) create a zero filled array of n
+ * elements, float32_array(t) / int32_array(t) copy the sequence t. */
+int mp_typed_array_new(lua_State *L, int type) {
+    mp_typed_array *arr;
+    size_t len, i;
+
+    if (lua_type(L, 1) == LUA_TTABLE) {
+#if LUA_VERSION_NUM < 502
+        len = lua_objlen(L, 1);
+#else
+        len = lua_rawlen(L, 1);
+#endif
+        arr = mp_push_typed_array(L, type, len);
+        for (i = 0; i < len; i++) {
+            lua_Number n;
+
+            lua_rawgeti(L, 1, i+1);
+            if (lua_type(L, -1) != LUA_TNUMBER)
+                return luaL_error(L, "Element %d of the array is not a number.", (int)i+1);
+            n = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            if (type == MP_TYPED_ARRAY_FLOAT32) {
+                ((float*)mp_typed_array_data(arr))[i] = mp_to_float(n);
+            } else {
+                if (!(n >= INT32_MIN && n <= INT32_MAX)) /* NaN too. */
+                    return luaL_error(L, "Element %d of the array is out of the int32 range.", (int)i+1);
+                ((int32_t*)mp_typed_array_data(arr))[i] = (int32_t)n;
+            }
+        }
+    } else {
+        lua_Number n = luaL_checknumber(L, 1);
+
+        if (!(n >= 0 && n <= (lua_Number)(INT_MAX/4))) /* NaN too. */
+            return luaL_argerror(L, 1, "invalid array size");
+        mp_push_typed_array(L, type, (size_t)n);
+    }
+    return 1;
+}
+
+int mp_float32_array(lua_State *L) { return mp_typed_array_new(L, MP_TYPED_ARRAY_FLOAT32); }
+int mp_int32_array(lua_State *L) { return mp_typed_array_new(L, MP_TYPED_ARRAY_INT32); }
+
+/* Return the 0 based element index for the key at index 2, or -1. */
+lua_Integer mp_typed_array_element(lua_State *L, mp_typed_array *arr) {
+    lua_Integer i;
+
+    if (lua_type(L, 2) != LUA_TNUMBER) return -1;
+    i = lua_tointeger(L, 2) - 1;
+    return (i >= 0 && (size_t)i < arr->len) ? i : -1;
+}
+
+int mp_typed_array_index(lua_State *L) {
+    mp_typed_array *arr = (mp_typed_array*)luaL_checkudata(L, 1, LUACMSGPACK_TYPED_ARRAY_MT);
+    lua_Integer i = mp_typed_array_element(L, arr);
+
+    if (i < 0)
+        lua_pushnil(L);
+    else if (arr->type == MP_TYPED_ARRAY_FLOAT32)
+        lua_pushnumber(L, ((float*)mp_typed_array_data(arr))[i]);
+    else
+        lua_pushinteger(L, ((int32_t*)mp_typed_array_data(arr))[i]);
+    return 1;
+}
+
+int mp_typed_array_newindex(lua_State *L) {
+    mp_typed_array *arr = (mp_typed_array*)luaL_checkudata(L, 1, LUACMSGPACK_TYPED_ARRAY_MT);
+    lua_Integer i = mp_typed_array_element(L, arr);
+    lua_Number n = luaL_checknumber(L, 3);
+
+    if (i < 0)
+        return luaL_error(L, "Index out of the bounds of an array of size %d.", (int)arr->len);
+    if (arr->frozen)
+        return luaL_error(L, "Attempt to modify a read-only array.");
+    if (arr->type == MP_TYPED_ARRAY_FLOAT32) {
+        ((float*)mp_typed_array_data(arr))[i] = mp_to_float(n);
+    } else {
+        if (!(n >= INT32_MIN && n <= INT32_MAX)) /* NaN too. */
+            return luaL_error(L, "Value out of the int32 range.");
+        ((int32_t*)mp_typed_array_data(arr))[i] = (int32_t)n;
+    }
+    return 0;
+}
+
+int mp_typed_array_len(lua_State *L) {
+    mp_typed_array *arr = (mp_typed_array*)luaL_checkudata(L, 1, LUACMSGPACK_TYPED_ARRAY_MT);
+
+    lua_pushinteger(L, (lua_Integer)arr->len);
+    return 1;
+}
+
+int mp_typed_array_tostring(lua_State *L) {
+    mp_typed_array *arr = (mp_typed_array*)luaL_checkudata(L, 1, LUACMSGPACK_TYPED_ARRAY_MT);
+
+    lua_pushfstring(L, "%s_array(%d)",
+        arr->type == MP_TYPED_ARRAY_FLOAT32 ? "float32" : "int32", (int)arr->len);
+    return 1;
+}
+
+const struct luaL_Reg vector_methods[] = {
+    {"__index", mp_vector_index},
+    {"__newindex", mp_vector_newindex},
+    {"__len", mp_vector_len},
+    {"__eq", mp_vector_eq},
+    {"__tostring", mp_vector_tostring},
+    {0}
+};
+
+const struct luaL_Reg typed_array_methods[] = {
+    {"__index", mp_typed_array_index},
+    {"__newindex", mp_typed_array_newindex},
+    {"__len", mp_typed_array_len},
+    {"__tostring", mp_typed_array_tostring},
+    {0}
+};
+
+/* Create (once per Lua state) the metatable 'tname' with the given methods.
+ * If the methods don't include __index, the metatable is its own __index so
+ * that the other methods can be called with the obj:method() syntax. */
+void mp_register_metatable(lua_State *L, const char *tname, const luaL_Reg *methods) {
+    int i;
+
+    if (luaL_newmetatable(L, tname)) {
+        for (i = 0; methods[i].name; i++) {
+            lua_pushcfunction(L, methods[i].func);
+            lua_setfield(L, -2, methods[i].name);
+        }
+        lua_getfield(L, -1, "__index");
+        if (lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -3, "__index");
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/* -------------------------------------------------------------------------- */
+const struct luaL_Reg cmds[] = {
+    {"pack", mp_pack},
+    {"pack_exact", mp_pack_exact},
+    {"pack_hashed", mp_pack_hashed},
+    {"pack_chunks", mp_pack_chunks},
+    {"size", mp_size},
+    {"size_max", mp_size_max},
+    {"unpack", mp_unpack},
+    {"unpack_one", mp_unpack_one},
+    {"unpack_limit", mp_unpack_limit},
+    {"unpack_into", mp_unpack_into},
+    {"unpack_verified", mp_unpack_verified},
+    {"pack_delta", mp_pack_delta},
+    {"apply_delta", mp_apply_delta},
+    {"new_dictionary", mp_dictionary_new},
+    {"to_json", mp_to_json},
+    {"from_json", mp_from_json},
+    {"new_cache", mp_cache_new},
+    {"len", mp_readonly_len},
+    {"pairs", mp_readonly_pairs},
+    {"ipairs", mp_readonly_ipairs},
+    {"decoder", mp_decoder_new},
+    {"vec2", mp_vec2},
+    {"vec3", mp_vec3},
+    {"vec4", mp_vec4},
+    {"float32_array", mp_float32_array},
+    {"int32_array", mp_int32_array},
+#ifdef LUACMSGPACK_STATS
+    {"stats", mp_stats_lua},
+    {"reset_stats", mp_reset_stats},
+#endif
+    {0}
+};
+
+/* Functions of cmds[] that report errors with mp_fail(), and so are made
+ * safe without a protected call. */
+const char *safe_cmds[] = {
+    "pack", "pack_hashed", "unpack", "unpack_one", "unpack_limit",
+    "unpack_into", "unpack_verified", "to_json", "from_json", NULL
+};
+
+int luaopen_create(lua_State *L) {
+    int i;
+    mp_register_metatable(L, LUACMSGPACK_VECTOR_MT, vector_methods);
+    mp_register_metatable(L, LUACMSGPACK_TYPED_ARRAY_MT, typed_array_methods);
+    mp_register_metatable(L, LUACMSGPACK_DECODER_MT, decoder_methods);
+    mp_register_metatable(L, LUACMSGPACK_DICTIONARY_MT, dictionary_methods);
+    mp_register_metatable(L, LUACMSGPACK_CACHE_MT, cache_methods);
+    mp_register_metatable(L, LUACMSGPACK_READONLY_MT, readonly_methods);
+    mp_register_metatable(L, LUACMSGPACK_CHUNKER_MT, chunker_methods);
+
+    /* Manually construct our module table instead of
+     * relying on _register or _newlib */
+    lua_newtable(L);
+
+    for (i = 0; i < (sizeof(cmds)/sizeof(*cmds) - 1); i++) {
         lua_pushcfunction(L, cmds[i].func);
         lua_setfield(L, -2, cmds[i].name);
     }
@@ -933,14 +4561,23 @@ LUALIB_API int luaopen_cmsgpack(lua_State *L) {
 }
 
 LUALIB_API int luaopen_cmsgpack_safe(lua_State *L) {
-    int i;
+    int i, j;
 
     luaopen_cmsgpack(L);
 
-    /* Wrap all functions in the safe handler */
     for (i = 0; i < (sizeof(cmds)/sizeof(*cmds) - 1); i++) {
-        lua_getfield(L, -1, cmds[i].name);
-        lua_pushcclosure(L, mp_safe, 1);
+        for (j = 0; safe_cmds[j]; j++)
+            if (!strcmp(safe_cmds[j], cmds[i].name)) break;
+
+        if (safe_cmds[j]) {
+            /* Register the function again with the safe mode upvalue */
+            lua_pushboolean(L, 1);
+            lua_pushcclosure(L, cmds[i].func, 1);
+        } else {
+            /* Wrap the function in the safe handler */
+            lua_getfield(L, -1, cmds[i].name);
+            lua_pushcclosure(L, mp_safe, 1);
+        }
         lua_setfield(L, -2, cmds[i].name);
     }
 
@@ -559,6 +559,716 @@ test_partial_unpack("unpack remaining 4", 4, {p=packed,o=offset,remaining={"d",
 test_unpack_one("simple", packed, "a")
 offset = test_unpack_one("simple", cmsgpack.pack({f = 3, j = 2}, "m", "e", 7), {f = 3, j = 2})
 test_unpack_one("simple", cmsgpack.pack({f = 3, j = 2}, "m", "e", 7), "m", offset)
+if math.type then
+    test_error("unpack_one non integer offset", function() cmsgpack.unpack_one(cmsgpack.pack(1, 2, 3), 2.5) end)
+    test_error("unpack_limit non integer limit", function() cmsgpack.unpack_limit(cmsgpack.pack(1, 2, 3), 1.5) end)
+end
+
+-- Encoded size estimation and exact single-allocation packing
+local function test_size(name, ...)
+    io.write("Testing size '",name,"' ...")
+    local packed = cmsgpack.pack(...)
+    local size = cmsgpack.size(...)
+    if size ~= #packed then
+        print("ERROR: size", size, "packed length", #packed)
+        failed = failed+1
+    elseif cmsgpack.pack_exact(...) ~= packed then
+        print("ERROR: pack_exact output differs from pack")
+        failed = failed+1
+    elseif cmsgpack.size_max(size, ...) ~= size or
+           cmsgpack.size_max(size - 1, ...) ~= false then
+        print("ERROR: size_max does not honor the maximum")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_size("integers", 0, 127, 128, -33, 65536, -2147483649, 0xFFFFFFFFFF)
+test_size("floats", 1.5, 0.1, -1e300, math.huge)
+test_size("strings", "", "abc", string.rep("x", 31), string.rep("x", 32), string.rep("x", 70000))
+test_size("tables", {}, {1,2,3}, {a=1, b={c={1,2,{d=true}}}}, {[1]=1, [3]=3})
+test_size("nested", a, b)
+test_error("size nothing", function() cmsgpack.size() end)
+test_error("size_max NaN", function() cmsgpack.size_max(0/0, "abc") end)
+if math.type then
+    io.write("Testing size 'integer results' ...")
+    if math.type(cmsgpack.size({1, 2})) == "integer" and
+       math.type(cmsgpack.size_max(100, "abc")) == "integer" then
+        print("ok")
+        passed = passed+1
+    else
+        print("ERROR")
+        failed = failed+1
+    end
+end
+
+-- Decoding into existing tables
+local function test_unpack_into(name, target, obj, check)
+    io.write("Testing unpack into '",name,"' ...")
+    local result = cmsgpack.unpack_into(cmsgpack.pack(obj), target)
+    if type(obj) == "table" and result ~= target then
+        print("ERROR: target table not reused")
+        failed = failed+1
+    elseif not compare_objects(result, obj) then
+        print("ERROR:", result, obj)
+        failed = failed+1
+    elseif check and not check(result) then
+        print("ERROR: nested tables not reused")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+local target = {}
+local pos, tags = {}, {}
+target.pos, target.tags = pos, tags
+test_unpack_into("empty target", {}, {a=1, b={1,2,3}, c={x=1}})
+test_unpack_into("nested reuse", target, {pos={x=1,y=2}, tags={"a","b","c"}, hp=100},
+    function(t) return t.pos == pos and t.tags == tags end)
+test_unpack_into("stale keys", target, {pos={x=5}, tags={"d"}},
+    function(t) return t.pos == pos and t.tags == tags and t.hp == nil and
+                       pos.y == nil and tags[2] == nil end)
+test_unpack_into("array stale keys", {1, 2, 3, x=1, [10]=10}, {9})
+test_unpack_into("map replacing array", {1, 2, 3}, {a=1})
+test_unpack_into("scalar", target, 5)
+test_unpack_into("unchanged after scalar", target, {pos={x=5}, tags={"d"}},
+    function(t) return t.pos == pos end)
+test_error("unpack into truncated", function() cmsgpack.unpack_into("\146\001", {}) end)
+test_error("unpack into non table", function() cmsgpack.unpack_into("\144", 1) end)
+
+-- Native vector types, encoded as ext values
+local function test_vector(name, obj, raw)
+    io.write("Testing vector '",name,"' ...")
+    local packed = cmsgpack.pack(obj)
+    local decoded = cmsgpack.unpack(packed)
+    local same = #decoded == #obj and
+        (type(obj) == "table" or tostring(decoded) == tostring(obj))
+    for i = 1, #obj do same = same and decoded[i] == obj[i] end
+    if hex(packed) ~= raw then
+        print("ERROR:", hex(packed), raw)
+        failed = failed+1
+    elseif not same then
+        print("ERROR: decoded", tostring(decoded), "expected", tostring(obj))
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_vector("vec2", cmsgpack.vec2(1, 2), "d7143f80000040000000")
+test_vector("vec3", cmsgpack.vec3(1, 2, 3), "c70c153f8000004000000040400000")
+test_vector("vec4", cmsgpack.vec4(0, -1, 0.5, 4), "d81600000000bf8000003f00000040800000")
+test_vector("float32 array", cmsgpack.float32_array({1.5, -2, 0.25}), "c70c173fc00000c00000003e800000")
+test_vector("int32 array", cmsgpack.int32_array({1, -1, 65536}), "c70c1800000001ffffffff00010000")
+test_vector("empty array", cmsgpack.int32_array(0), "c70018")
+test_vector("large float32 array", cmsgpack.float32_array(1000),
+    "c80fa017" .. string.rep("00", 4000))
+test_size("vectors", cmsgpack.vec3(1, 2, 3), {cmsgpack.float32_array(100)})
+local v = cmsgpack.vec3(1, 2, 3)
+v.y = 20
+test_circular("vector fields", {v.x, v.y, v.z, v[3], v.w})
+test_vector("vector in table", {cmsgpack.vec2(5, 6)}, "91d71440a0000040c00000")
+test_error("vector bad component", function() v.q = 1 end)
+do
+    local big = cmsgpack.vec2(1e300, -1e300)
+    local arr = cmsgpack.float32_array({1e300, 0})
+    arr[2] = -1e39
+    big.y = 1e39
+    io.write("Testing float overflow is infinity ...")
+    if big.x == 1/0 and big.y == 1/0 and arr[1] == 1/0 and arr[2] == -1/0 then
+        print("ok")
+        passed = passed+1
+    else
+        print("ERROR")
+        failed = failed+1
+    end
+end
+test_error("int32 array out of range", function() cmsgpack.int32_array({2^40}) end)
+test_error("int32 array NaN", function() cmsgpack.int32_array({0/0}) end)
+test_error("typed array NaN size", function() cmsgpack.float32_array(0/0) end)
+test_error("int32 array NaN assignment", function() cmsgpack.int32_array(1)[1] = 0/0 end)
+test_error("int32 array out of range assignment", function() cmsgpack.int32_array(1)[1] = -2^31-1 end)
+if math.type then
+    io.write("Testing typed array length is an integer ...")
+    if math.type(#cmsgpack.float32_array(3)) == "integer" then
+        print("ok")
+        passed = passed+1
+    else
+        print("ERROR")
+        failed = failed+1
+    end
+end
+test_error("unknown ext type", function() cmsgpack.unpack("\212\001\000") end)
+test_error("vector ext with bad size", function() cmsgpack.unpack("\214\020\000\000\000\000") end)
+
+-- Numeric arrays take a batched fast path: check it against the generic
+-- scalar encoder, that is used when values are packed one by one.
+local function test_numeric_array(name, t)
+    io.write("Testing numeric array '",name,"' ...")
+    local header = #t < 16 and string.char(0x90 + #t) or
+        string.char(0xdc, math.floor(#t / 256), #t % 256)
+    local packed = cmsgpack.pack(t)
+    if packed ~= header .. cmsgpack.pack(unpack(t)) then
+        print("ERROR: fast path differs from generic encoding", hex(packed))
+        failed = failed+1
+    elseif not compare_objects(cmsgpack.unpack(packed), t) then
+        print("ERROR: round trip mismatch")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+local doubles, mixed = {}, {}
+for i = 1, 1000 do
+    doubles[i] = i / 3
+    mixed[i] = (i % 3 == 0 and i) or (i % 3 == 1 and i + 0.5) or -i / 7
+end
+test_numeric_array("small", {1, 2.5, 0.1, -1, 300, -40000, 2^40, -2^40})
+test_numeric_array("specials", {0, -0.0, 1/0, -1/0, 1e308, 1e-308})
+test_numeric_array("doubles", doubles)
+test_numeric_array("mixed", mixed)
+test_pack_and_unpack("numeric array", {1, 1.5, 0.1, 127, 128},
+    "9501ca3fc00000cb3fb999999999999a7fcc80")
+test_unpack("fixnum run", "9400017f05", {0, 1, 127, 5})
+test_unpack("float run then string", "93ca3fc00000ca3fc00000a161", {1.5, 1.5, "a"})
+test_error("truncated double run", function()
+    cmsgpack.unpack(unhex("92cb3ff0000000000000cb3ff0")) end)
+
+-- Decoding limits
+local function test_limits(name, fn, ok_expected)
+    io.write("Testing limits '",name,"' ...")
+    local ok, err = pcall(fn)
+    if ok ~= ok_expected then
+        print("ERROR:", ok, err)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+local nested = cmsgpack.pack({{{1}}})
+local strmsg = cmsgpack.pack(string.rep("x", 100))
+-- Headers announcing more elements than the input bytes are rejected by the
+-- O(1) check, before anything is allocated, as missing bytes.
+local function test_huge_header(name, msg)
+    io.write("Testing limits '",name,"' ...")
+    local ok, err = pcall(cmsgpack.unpack, msg)
+    if ok or not tostring(err):find("Missing bytes", 1, true) then
+        print("ERROR:", ok, err)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+test_huge_header("huge array header", "\221\255\255\255\255")
+test_huge_header("huge map header", "\223\255\255\255\255")
+test_huge_header("huge nested header", "\146\001\221\000\255\255\255\001")
+test_limits("max_bytes", function() cmsgpack.unpack(strmsg, {max_bytes=100}) end, false)
+test_limits("max_bytes ok", function() cmsgpack.unpack(strmsg, {max_bytes=102}) end, true)
+test_limits("max_string", function() cmsgpack.unpack(strmsg, {max_string=99}) end, false)
+test_limits("max_string ok", function() cmsgpack.unpack(strmsg, {max_string=100}) end, true)
+test_limits("max_string ext", function() cmsgpack.unpack(cmsgpack.pack(cmsgpack.vec4(1,2,3,4)), {max_string=8}) end, false)
+test_limits("max_depth", function() cmsgpack.unpack(nested, {max_depth=2}) end, false)
+test_limits("max_depth ok", function() cmsgpack.unpack(nested, {max_depth=3}) end, true)
+test_limits("max_container", function() cmsgpack.unpack(cmsgpack.pack({1,2,3}), {max_container=2}) end, false)
+test_limits("max_container map", function() cmsgpack.unpack(cmsgpack.pack({a=1,b=2}), {max_container=1}) end, false)
+test_limits("max_objects", function() cmsgpack.unpack(cmsgpack.pack({1,2,3}), {max_objects=3}) end, false)
+test_limits("max_objects ok", function() cmsgpack.unpack(cmsgpack.pack({1,2,3}), {max_objects=4}) end, true)
+test_limits("max_objects stream", function() cmsgpack.unpack(cmsgpack.pack(1,2,3), {max_objects=2}) end, false)
+test_limits("unpack_one limits", function() cmsgpack.unpack_one(nested, 0, {max_depth=1}) end, false)
+test_limits("unpack_limit limits", function() cmsgpack.unpack_limit(nested, 1, 0, {max_depth=1}) end, false)
+test_limits("unpack_into limits", function() cmsgpack.unpack_into(nested, {}, {max_depth=1}) end, false)
+test_limits("negative limit", function() cmsgpack.unpack(strmsg, {max_bytes=-1}) end, false)
+test_limits("NaN limit", function() cmsgpack.unpack(strmsg, {max_container=0/0}) end, false)
+
+local decoder = cmsgpack.decoder({max_depth=2, max_string=10})
+test_limits("decoder unpack", function() decoder:unpack(nested) end, false)
+test_limits("decoder unpack_one", function() decoder:unpack_one(strmsg) end, false)
+test_limits("decoder unpack_limit", function() decoder:unpack_limit(strmsg, 1) end, false)
+test_limits("decoder unpack_into", function() decoder:unpack_into(nested, {}) end, false)
+test_limits("decoder ok", function()
+    local a, b = decoder:unpack(cmsgpack.pack({{1}}, "abc"))
+    assert(a[1][1] == 1 and b == "abc")
+    local offset, v = decoder:unpack_one(cmsgpack.pack("abc", 1))
+    assert(offset == 4 and v == "abc")
+    assert(decoder:unpack_into(cmsgpack.pack({x=1}), {}).x == 1)
+end, true)
+
+-- Hashing while packing and verifying while unpacking
+local function test_hashed(name, digest, ...)
+    io.write("Testing hashed '",name,"' ...")
+    local data, hash = cmsgpack.pack_hashed(...)
+    if data ~= cmsgpack.pack(...) then
+        print("ERROR: pack_hashed output differs from pack")
+        failed = failed+1
+    elseif digest and hex(hash) ~= digest then
+        print("ERROR: digest", hex(hash), "expected", digest)
+        failed = failed+1
+    elseif not compare_objects({cmsgpack.unpack_verified(data .. hash)}, {...}) then
+        print("ERROR: unpack_verified mismatch")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_hashed("short string", "448883a18b63e895", "abc")
+test_hashed("long string", "7fad83426917e0c4", string.rep("x", 1000))
+test_hashed("stream", nil, 1, {a={1,2,3}, b=string.rep("y", 300)}, doubles, "z")
+local data, hash = cmsgpack.pack_hashed({1, 2, 3}, string.rep("x", 500))
+test_error("digest mismatch", function()
+    cmsgpack.unpack_verified(data:sub(1, -2) .. "y" .. hash) end)
+test_error("bad digest", function()
+    cmsgpack.unpack_verified(data .. hash:sub(1, 7) .. "\000") end)
+test_error("missing digest", function() cmsgpack.unpack_verified("\001") end)
+test_error("verified limits", function()
+    cmsgpack.unpack_verified(data .. hash, {max_string=10}) end)
+
+-- Delta encoding against a previous snapshot
+local function deep_copy(t)
+    if type(t) ~= "table" then return t end
+    local c = {}
+    for k, v in pairs(t) do c[k] = deep_copy(v) end
+    return c
+end
+
+local function test_delta(name, old, new, raw)
+    io.write("Testing delta '",name,"' ...")
+    local patch = cmsgpack.pack_delta(old, new)
+    local target = deep_copy(old)
+    local result = cmsgpack.apply_delta(target, patch)
+    if raw and hex(patch) ~= raw then
+        print("ERROR: patch", hex(patch), "expected", raw)
+        failed = failed+1
+    elseif result ~= target or not compare_objects(target, new) then
+        print("ERROR: patched table differs from the new one")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+local entity = {id=7, pos={x=1, y=2, z=3}, hp=100, tags={"a","b"}, inv={{id=1},{id=2}}}
+local moved = deep_copy(entity)
+moved.pos.x, moved.hp, moved.tags[3] = 5, 90, "c"
+moved.inv[2] = nil
+test_delta("unchanged", entity, deep_copy(entity), "80")
+test_delta("changed field", {a=1, b=2}, {a=1, b=3}, "81a16203")
+test_delta("nested field", {p={x=1, y=2}}, {p={x=1, y=5}}, "81a170d61981a17905")
+test_delta("added and removed", {a=1, b=2}, {b=2, c=3})
+test_delta("table replaces scalar", {a=1}, {a={1,2}})
+test_delta("scalar replaces table", {a={1,2}}, {a=1})
+test_delta("entity", entity, moved)
+test_delta("array shrink", {1,2,3,4}, {1,2})
+test_delta("empty", {}, {})
+test_delta("cleared", entity, {})
+
+local function nested(levels, leaf)
+    local t = {v=leaf}
+    for i = 2, levels do t = {n=t} end
+    return t
+end
+-- 16 nested tables is the LUACMSGPACK_MAX_NESTING default
+test_delta("change at the nesting limit", nested(16, 1), nested(16, 2))
+test_error("change past the nesting limit", function() cmsgpack.pack_delta(nested(17, 1), nested(17, 2)) end)
+test_error("new table past the nesting limit", function() cmsgpack.pack_delta(nested(16, 1), nested(16, {})) end)
+test_delta("new subtree at the nesting limit", {k=1}, {k=nested(15, 5)})
+test_error("new subtree past the nesting limit", function() cmsgpack.pack_delta({k=1}, {k=nested(20, 5)}) end)
+test_error("new key past the nesting limit", function() cmsgpack.pack_delta({}, {[nested(16, 5)]=1}) end)
+
+io.write("Testing delta 'nested tables reused' ...")
+local target = deep_copy(entity)
+local pos = target.pos
+cmsgpack.apply_delta(target, cmsgpack.pack_delta(entity, moved))
+if target.pos == pos and pos.x == 5 then
+    print("ok")
+    passed = passed+1
+else
+    print("ERROR: nested table replaced")
+    failed = failed+1
+end
+test_error("delta not a map", function() cmsgpack.apply_delta({}, cmsgpack.pack(1)) end)
+test_error("delta trailing data", function() cmsgpack.apply_delta({}, "\128\001") end)
+test_error("delta truncated", function()
+    cmsgpack.apply_delta({}, cmsgpack.pack_delta({p={x=1}}, {p={x=2}}):sub(1, -2)) end)
+test_error("delta needs tables", function() cmsgpack.pack_delta({}, 1) end)
+
+-- Shared key dictionaries
+local dict = cmsgpack.new_dictionary({"position", "velocity", "id", "ab", "health"})
+local function test_dictionary(name, obj, raw)
+    io.write("Testing dictionary '",name,"' ...")
+    local packed = dict:pack(obj)
+    if raw and hex(packed) ~= raw then
+        print("ERROR: packed", hex(packed), "expected", raw)
+        failed = failed+1
+    elseif #packed > #cmsgpack.pack(obj) then
+        print("ERROR: dictionary encoding is longer")
+        failed = failed+1
+    elseif not compare_objects(dict:unpack(packed), obj) then
+        print("ERROR: round trip mismatch")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_dictionary("known key", {position=1}, "81d41a0001")
+test_dictionary("short key stays a string", {ab=1}, "81a2616201")
+test_dictionary("unknown key", {other=1}, "81a56f7468657201")
+test_dictionary("values are not replaced", {"position", "health"})
+test_dictionary("nested", {id=7, position={1,2,3}, sub={velocity={x=1}, health=5}})
+local long_keys = {}
+for i = 1, 300 do long_keys[i] = "key" .. i end
+local big_dict = cmsgpack.new_dictionary(long_keys)
+io.write("Testing dictionary 'wide index' ...")
+local packed = big_dict:pack({key300=1, key2=2})
+if hex(big_dict:pack({key300=1})) == "81d51a012b01" and
+   compare_objects(big_dict:unpack(packed), {key300=1, key2=2}) and
+   compare_objects(dict:unpack(cmsgpack.pack({position=1})), {position=1}) then
+    print("ok")
+    passed = passed+1
+else
+    print("ERROR:", hex(big_dict:pack({key300=1})))
+    failed = failed+1
+end
+test_error("dictionary reference without dictionary", function()
+    cmsgpack.unpack(dict:pack({position=1})) end)
+test_error("dictionary reference out of range", function() dict:unpack("\129\212\026\099\001") end)
+test_error("dictionary duplicated key", function() cmsgpack.new_dictionary({"a", "a"}) end)
+test_error("dictionary non string key", function() cmsgpack.new_dictionary({"a", 1}) end)
+
+-- JSON transcoding
+local function test_to_json(name, json, ...)
+    io.write("Testing to_json '",name,"' ...")
+    local result = cmsgpack.to_json(cmsgpack.pack(...))
+    if result ~= json then
+        print("ERROR:", result, "expected", json)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+local function test_from_json(name, json, ...)
+    io.write("Testing from_json '",name,"' ...")
+    local result = {cmsgpack.unpack(cmsgpack.from_json(json))}
+    if not compare_objects(result, {...}) then
+        print("ERROR:", cmsgpack.to_json(cmsgpack.from_json(json)))
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_to_json("scalars", "null\ntrue\nfalse\n0\n-1\n300\n-40000\n1.5\n0.1", nil, true, false, 0, -1, 300, -40000, 1.5, 0.1)
+test_to_json("string escapes", '"a\\"b\\\\c\\n\\t\\u0001\195\169"', 'a"b\\c\n\t\1\195\169')
+test_to_json("array", "[1,2,[3,[]]]", {1, 2, {3, {}}})
+test_to_json("map", '{"a":{"b":"c"}}', {a={b="c"}})
+test_to_json("non string keys", '{"1.5":true}', {[1.5]=true})
+test_to_json("special floats", "[null,null]", {1/0, -1/0})
+test_to_json("vectors", "[1,2.5]\n[-1,2]", cmsgpack.vec2(1, 2.5), cmsgpack.int32_array({-1, 2}))
+io.write("Testing to_json 'int64' ...")
+if cmsgpack.to_json(unhex("cfffffffffffffffff")) == "18446744073709551615" and
+   cmsgpack.to_json(unhex("d38000000000000000")) == "-9223372036854775808" then
+    print("ok")
+    passed = passed+1
+else
+    print("ERROR")
+    failed = failed+1
+end
+io.write("Testing to_json 'binary' ...")
+if cmsgpack.to_json(unhex("c403616263c5000162c60000000163")) == '"abc"\n"b"\n"c"' and
+   cmsgpack.to_json(unhex("81c4016101")) == '{"a":1}' then
+    print("ok")
+    passed = passed+1
+else
+    print("ERROR")
+    failed = failed+1
+end
+test_error("to_json table key", function() cmsgpack.to_json(unhex("8190c0")) end)
+test_error("to_json truncated", function() cmsgpack.to_json(unhex("92c0")) end)
+test_error("to_json limits", function() cmsgpack.to_json(cmsgpack.pack({{1}}), {max_depth=1}) end)
+
+test_from_json("scalars", " null true false 0 -1 300 1.5 -12.5e3 ", nil, true, false, 0, -1, 300, 1.5, -12500)
+test_from_json("containers", '{"a":[1,{"b":[]}],"c":{}}', {a={1,{b={}}},c={}})
+test_from_json("string escapes", '"a\\"\\/\\u00e9\\ud83d\\ude00"', 'a"/\195\169\240\159\152\128')
+test_from_json("long string", '"' .. string.rep("x", 70000) .. '"', string.rep("x", 70000))
+test_from_json("big integer", "18446744073709551616 -9223372036854775808", 2^64, -2^63)
+test_from_json("round trip", cmsgpack.to_json(cmsgpack.pack(entity)), entity)
+do
+    io.write("Testing from_json 'header sizes' ...")
+    local big = {}
+    for i = 1, 65536 do big[i] = i % 100 end
+    local value = {string.rep("x", 31), string.rep("y", 32), string.rep("z", 300),
+                   {}, {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16}, {a={b={c="d"}}}, big}
+    local msgpack = cmsgpack.pack(value)
+    if cmsgpack.from_json(cmsgpack.to_json(msgpack)) == msgpack then
+        print("ok")
+        passed = passed+1
+    else
+        print("ERROR")
+        failed = failed+1
+    end
+end
+do
+    io.write("Testing JSON numbers with ',' as decimal point ...")
+    local old, found = os.setlocale(nil, "numeric")
+    for _, name in ipairs({"de_DE.UTF-8", "de_DE.utf8", "de_DE",
+                           "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR"}) do
+        if os.setlocale(name, "numeric") and string.format("%.1f", 0.5) == "0,5" then
+            found = true
+            break
+        end
+    end
+    if not found then
+        os.setlocale(old, "numeric")
+        print("skip: no locale with ',' as decimal point")
+        skipped = skipped + 1
+    else
+        local json = cmsgpack.to_json(cmsgpack.pack(1.5, {0.25}))
+        local a, b = cmsgpack.unpack(cmsgpack.from_json("1.5 [-2.5e3]"))
+        os.setlocale(old, "numeric")
+        if json == "1.5\n[0.25]" and a == 1.5 and b[1] == -2500 then
+            print("ok")
+            passed = passed+1
+        else
+            print("ERROR:", json, a, b[1])
+            failed = failed+1
+        end
+    end
+end
+test_error("from_json trailing comma", function() cmsgpack.from_json("[1,]") end)
+test_error("from_json missing colon", function() cmsgpack.from_json('{"a" 1}') end)
+test_error("from_json lone surrogate", function() cmsgpack.from_json('"\\ud800"') end)
+test_error("from_json control char", function() cmsgpack.from_json('"\1"') end)
+test_error("from_json unseparated values", function() cmsgpack.from_json("01") end)
+test_error("from_json truncated", function() cmsgpack.from_json('{"a":[1') end)
+test_error("from_json too deep", function()
+    cmsgpack.from_json(string.rep("[", 1000) .. string.rep("]", 1000)) end)
+
+-- Decode cache
+local function test_cache(name, ok)
+    io.write("Testing cache '",name,"' ...")
+    if not ok then
+        print("ERROR")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+do
+    local cache = cmsgpack.new_cache(100)
+    local msg = cmsgpack.pack({a={1,2,3}, b="x"})
+    local t1 = cache:unpack(msg)
+    local t2 = cache:unpack(msg)
+    local st = cache:stats()
+    test_cache("shared result", t1 == t2 and t1.a == t2.a and t1.b == "x" and t1.a[3] == 3)
+    test_cache("counters", st.hits == 1 and st.misses == 1 and st.entries == 1 and
+        st.bytes == #msg and st.budget == 100)
+    if math.type then
+        test_cache("integer counters", math.type(st.hits) == "integer" and
+            math.type(st.bytes) == "integer" and math.type(st.budget) == "integer")
+    end
+    test_cache("unlimited budget", cmsgpack.new_cache(math.huge):stats().budget > 0)
+    test_error("cache read-only", function() t1.c = 1 end)
+    test_error("cache nested read-only", function() t1.a[1] = 5 end)
+    test_error("cache protected metatable", function() setmetatable(t1, nil) end)
+    test_cache("repack proxy", cmsgpack.pack(t1) == msg)
+    test_error("cache unpack_into read-only", function()
+        cmsgpack.unpack_into(cmsgpack.pack({a=5, z=7}), t1) end)
+    test_error("cache apply_delta read-only", function()
+        cmsgpack.apply_delta(t1, cmsgpack.pack_delta({}, {z=7})) end)
+    test_error("cache apply_delta nested read-only", function()
+        cmsgpack.apply_delta({a=t1.a}, cmsgpack.pack_delta({a={1}}, {a={1, 5}})) end)
+    do
+        local cached = cache:unpack(cmsgpack.pack({x=1, y=2, n={1, 2}}))
+        local plain = {x=1, y=2, n={1, 2}}
+        cmsgpack.apply_delta(plain, cmsgpack.pack_delta(cached, {x=1, n={1, 3}}))
+        local back = cmsgpack.apply_delta({x=1, y=2, n={1, 2}}, cmsgpack.pack_delta({x=1, n={1, 3}}, cached))
+        test_cache("pack_delta of proxies", cmsgpack.pack_delta(cached, {x=1, y=2, n={1, 2}}) == "\128" and
+            plain.y == nil and plain.n[2] == 3 and back.y == 2 and back.n[2] == 2)
+    end
+    local holder = {a=t1.a}
+    cmsgpack.unpack_into(cmsgpack.pack({a={9}}), holder)
+    test_cache("unpack_into replaces nested proxy", holder.a[1] == 9 and holder.a ~= t1.a and
+        t1.a[1] == 1 and t1.z == nil and cmsgpack.pack(t1) == msg)
+    test_cache("multiple values", select('#', cache:unpack(cmsgpack.pack(nil, 1, nil))) == 3 and
+        select(2, cache:unpack(cmsgpack.pack(nil, 1, nil))) == 1)
+    local sum, keys = 0, 0
+    for _, v in cmsgpack.pairs(t1.a) do sum = sum + v end
+    for _, v in cmsgpack.ipairs(t1.a) do sum = sum + v end
+    for k in cmsgpack.pairs(t1) do keys = keys + 1 end
+    test_cache("proxy iteration helpers", cmsgpack.len(t1.a) == 3 and sum == 12 and keys == 2)
+    test_cache("helpers on plain tables", cmsgpack.len({1, 2}) == 2 and cmsgpack.pairs({}) ~= nil)
+    test_error("cache pairs state read-only", function()
+        local _, state = cmsgpack.pairs(t1)
+        state.b = "y"
+    end)
+    test_error("cache ipairs state read-only", function()
+        local _, state = cmsgpack.ipairs(t1.a)
+        state[1] = 5
+    end)
+    if _VERSION ~= "Lua 5.1" then
+        sum = 0
+        for _, v in pairs(t1.a) do sum = sum + v end
+        for _, v in ipairs(t1.a) do sum = sum + v end
+        test_cache("proxy iteration", #t1.a == 3 and sum == 12)
+    end
+
+    for i = 1, 100 do cache:unpack(cmsgpack.pack(i, string.rep("y", 20))) end
+    st = cache:stats()
+    test_cache("budget", st.bytes <= 100 and st.entries == 4 and st.evictions > 0)
+    test_cache("evicted", cache:unpack(cmsgpack.pack(1, string.rep("y", 20))) == 1 and
+        cache:stats().misses == st.misses + 1)
+    test_cache("lru hit", cache:unpack(cmsgpack.pack(99, string.rep("y", 20))) == 99 and
+        cache:stats().hits == st.hits + 1)
+    test_cache("too large", #cache:unpack(cmsgpack.pack(string.rep("z", 200))) == 200 and
+        cache:stats().entries == 4)
+    test_error("cache bad input", function() cache:unpack(unhex("92c0")) end)
+    do
+        local vmsg = cmsgpack.pack({v=cmsgpack.vec2(1, 2), a=cmsgpack.int32_array({1})}, cmsgpack.vec3(1, 2, 3))
+        local t, v = cache:unpack(vmsg)
+        test_error("cache vector read-only", function() t.v.x = 42 end)
+        test_error("cache typed array read-only", function() t.a[1] = 42 end)
+        test_error("cache top level vector read-only", function() v[1] = 42 end)
+        local plain = cmsgpack.unpack(vmsg)
+        plain.v.x = 42
+        test_cache("frozen values unchanged", cache:unpack(vmsg).v.x == 1 and plain.v.x == 42)
+    end
+    test_error("cache negative budget", function() cmsgpack.new_cache(-1) end)
+    test_error("cache NaN budget", function() cmsgpack.new_cache(0/0) end)
+end
+
+-- Chunked encoding
+local function test_chunks(name, size, obj)
+    io.write("Testing pack_chunks '",name,"' size ",size," ...")
+    local chunks, ok = {}, true
+    for chunk in cmsgpack.pack_chunks(obj, size) do
+        if #chunk > size or (#chunks > 0 and #chunks[#chunks] ~= size) then ok = false end
+        chunks[#chunks+1] = chunk
+    end
+    if not ok or table.concat(chunks) ~= cmsgpack.pack(obj) then
+        print("ERROR:", #chunks, #table.concat(chunks), #cmsgpack.pack(obj))
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+do
+    local snapshot = {}
+    for i = 1, 200 do
+        snapshot[i] = {id=i, name="entity"..i, pos=cmsgpack.vec3(i, 0, -i), hp=i/7, tags={"a", "b"}}
+    end
+    for _, size in ipairs({1, 5, 64, 4096}) do
+        test_chunks("scalar", size, 3.5)
+        test_chunks("long string", size, string.rep("x", 70000))
+        test_chunks("nested", size, {a={b={c={1, 2, {d="e"}}}}, [1.5]=true})
+        test_chunks("snapshot", size, snapshot)
+    end
+    test_chunks("empty table", 8, {})
+    test_chunks("circular", 8, a)
+    test_chunks("cached proxy", 8, cmsgpack.new_cache(100):unpack(cmsgpack.pack({x={1,2}})))
+    test_error("pack_chunks size", function() cmsgpack.pack_chunks({}, 0) end)
+    test_error("pack_chunks NaN size", function() cmsgpack.pack_chunks({}, 0/0) end)
+end
+
+-- Safe API error results
+local function test_safe_error(name, msg, fn, ...)
+    io.write("Testing safe error '",name,"' ...")
+    if not cmsgpack_safe then
+        print("skip: no `cmsgpack.safe` module")
+        skipped = skipped + 1
+        return
+    end
+    local ok, ret, err = pcall(fn, ...)
+    if not ok or ret ~= nil or type(err) ~= "string" or not err:find(msg, 1, true) then
+        print("ERROR: result ", ok, ret, err)
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+if cmsgpack_safe then
+    test_safe_error("unpack nil", "string expected", cmsgpack_safe.unpack, nil)
+    test_safe_error("unpack truncated", "Missing bytes", cmsgpack_safe.unpack, unhex("92c0"))
+    test_safe_error("unpack bad format", "Bad data format", cmsgpack_safe.unpack, unhex("c1"))
+    test_safe_error("unpack limits", "decoding limits", cmsgpack_safe.unpack,
+        cmsgpack.pack({1,2,3}), {max_container=2})
+    test_safe_error("unpack bad limits", "non negative", cmsgpack_safe.unpack, unhex("01"), {max_depth=-1})
+    test_safe_error("unpack_one offset", "number expected", cmsgpack_safe.unpack_one, unhex("01"), "x")
+    test_safe_error("unpack_limit offset", "greater than input length", cmsgpack_safe.unpack_limit, unhex("01"), 1, 5)
+    if math.type then
+        test_safe_error("unpack_limit non integer", "no integer representation", cmsgpack_safe.unpack_limit, unhex("01"), 1.5)
+    end
+    test_safe_error("unpack_into target", "table expected", cmsgpack_safe.unpack_into, unhex("01"))
+    test_safe_error("unpack_verified digest", "Digest mismatch", cmsgpack_safe.unpack_verified,
+        unhex("010000000000000000"))
+    test_safe_error("unpack too many values", "use unpack_one", cmsgpack_safe.unpack, string.rep("\1", 2000000))
+    test_safe_error("unpack nil key", "Bad data format", cmsgpack_safe.unpack, "\129\192\001")
+    test_safe_error("unpack NaN key", "Bad data format", cmsgpack_safe.unpack, unhex("81ca7fc0000001"))
+    test_safe_error("unpack_one nil key", "Bad data format", cmsgpack_safe.unpack_one, "\129\192\001")
+    test_safe_error("unpack_limit NaN key", "Bad data format", cmsgpack_safe.unpack_limit, unhex("81ca7fc0000001"), 1)
+    test_safe_error("unpack_into nil key", "Bad data format", cmsgpack_safe.unpack_into, "\129\192\001", {})
+    test_safe_error("unpack_into NaN key", "Bad data format", cmsgpack_safe.unpack_into, unhex("81ca7fc0000001"), {})
+    test_safe_error("pack nothing", "needs input", cmsgpack_safe.pack)
+    test_safe_error("from_json invalid", "offset 3", cmsgpack_safe.from_json, "[1,")
+    test_safe_error("to_json truncated", "Missing bytes", cmsgpack_safe.to_json, unhex("92c0"))
+    test_safe_error("wrapped size", "needs input", cmsgpack_safe.size)
+end
+test_error("unpack too many values", function() cmsgpack.unpack(string.rep("\1", 2000000)) end)
+
+-- Instrumentation counters (only with LUACMSGPACK_STATS)
+local function test_stats()
+    io.write("Testing stats counters ...")
+    if not cmsgpack.stats then
+        print("skip: built without LUACMSGPACK_STATS")
+        skipped = skipped + 1
+        return
+    end
+    cmsgpack.reset_stats()
+    local packed = cmsgpack.pack({1, 2, {a = "x"}}, 1.5)
+    cmsgpack.unpack(packed)
+    local st = cmsgpack.stats()
+    if st.bytes_encoded ~= #packed or st.bytes_decoded ~= #packed or
+       st.tables_as_array ~= 1 or st.tables_as_map ~= 1 or
+       st.encoded.integer ~= 2 or st.decoded.float ~= 1 or
+       st.decoded.string ~= 2 or st.max_decode_depth ~= 2 or
+       st.pack_calls ~= 1 or st.unpack_calls ~= 1 then
+        print("ERROR: unexpected counters")
+        failed = failed+1
+        return
+    end
+    cmsgpack.reset_stats()
+    if cmsgpack.stats().bytes_encoded ~= 0 then
+        print("ERROR: reset_stats() did not clear the counters")
+        failed = failed+1
+    else
+        print("ok")
+        passed = passed+1
+    end
+end
+
+test_stats()
 
 -- Final report
 print()